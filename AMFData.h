@@ -65,15 +65,337 @@ public:
     return AMF_TYPE_UNKNOWN;
   }
 
-  virtual void write(fout& fp) const {
+  // Write asString() to f, without building it up in memory first
+  virtual void dump(FILE* f) const {
+    fputs(asString().c_str(), f);
+  }
+
+  // Write the value to f as JSON
+  virtual void dumpJSON(FILE* f) const {
+    fputs("null", f);
+  }
+
+  // Serialize into p, which must have room for serializedSize() bytes; returns the end of what was written
+  virtual char* encode(char*) const {
     throw std::runtime_error("AMFData (subtype AMF_TYPE_UNKNOWN): writing this type is meaningless");
   }
 
+  // Exact number of bytes encode() will produce, including the type byte
+  virtual size_t serializedSize() const {
+    throw std::runtime_error("AMFData (subtype AMF_TYPE_UNKNOWN): writing this type is meaningless");
+  }
+
+  void write(fout& fp) const {
+    vector<char> buf(serializedSize());
+    if (buf.empty()) return;
+    encode(&buf[0]);
+    fp.write(&buf[0], buf.size());
+  }
+
   // Factory to produce the right subclass of AMFData object
   static shared_ptr<AMFData> construct(serialized_buffer& buf);
 
 protected:
+  // asString() for the types that can get big: dump() into memory, which doesn't get
+  // slower the more there is, as adding strings together does
+  string dumped() const {
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* f = open_memstream(&buf, &len);
+    if (! f) throw std::bad_alloc();
+    dump(f);
+    fclose(f);
+    string r(buf, len);
+    free(buf);
+    return r;
+  }
+
+  // JSON has no NaN or infinity, and wants no more digits than it takes to get the same double back
+  static void dump_json_double(FILE* f, double d) {
+    if (! isfinite(d)) {
+      fputs("null", f);
+      return;
+    }
+    char buf[32];
+    snprintf(buf, 32, "%.15g", d);
+    if (strtod(buf, NULL) != d) snprintf(buf, 32, "%.17g", d);
+    fputs(buf, f);
+  }
+  // Strings in files from other tools are often Latin-1 rather than UTF-8, and JSON has to be
+  // UTF-8: valid UTF-8 goes through as it is, and any other byte is taken as Latin-1 and escaped
+  static void dump_json_string(FILE* f, const char* s, size_t len) {
+    fputc('"', f);
+    for (size_t i = 0; i < len; ++i) {
+      unsigned char c = s[i];
+      if (c == '"' || c == '\\') {
+        fputc('\\', f);
+        fputc(c, f);
+      } else if (c < 0x20) {
+        fprintf(f, "\\u%04x", c);
+      } else if (c < 0x80) {
+        fputc(c, f);
+      } else {
+        size_t n = utf8_length((const unsigned char*)s + i, len - i);
+        if (n) {
+          fwrite(s + i, 1, n, f);
+          i += n - 1;
+        } else {
+          fprintf(f, "\\u%04x", c);
+        }
+      }
+    }
+    fputc('"', f);
+  }
+  // The length of the well-formed UTF-8 sequence starting with the non-ASCII byte at p (no
+  // overlong forms, surrogates or code points past U+10FFFF), or 0 if there isn't one
+  static size_t utf8_length(const unsigned char* p, size_t left) {
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xbf; // what the second byte can be
+    if (p[0] >= 0xc2 && p[0] <= 0xdf) n = 2;
+    else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+      n = 3;
+      if (p[0] == 0xe0) lo = 0xa0;
+      if (p[0] == 0xed) hi = 0x9f;
+    } else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+      n = 4;
+      if (p[0] == 0xf0) lo = 0x90;
+      if (p[0] == 0xf4) hi = 0x8f;
+    } else return 0;
+    if (left < n || p[1] < lo || p[1] > hi) return 0;
+    for (size_t k = 2; k < n; ++k) {
+      if ((p[k] & 0xc0) != 0x80) return 0;
+    }
+    return n;
+  }
 
+  // big-endian stores for encode()
+  static char* put_u16_be(char* p, uint16_t d) {
+    p[0] = (d >> 8) & 0xff;
+    p[1] = d & 0xff;
+    return p + 2;
+  }
+  static char* put_u32_be(char* p, uint32_t d) {
+    p[0] = (d >> 24) & 0xff;
+    p[1] = (d >> 16) & 0xff;
+    p[2] = (d >> 8) & 0xff;
+    p[3] = d & 0xff;
+    return p + 4;
+  }
+  static char* put_double_be(char* p, double d) {
+    union {
+      uint64_t a;
+      double b;
+    } _d;
+    _d.b = d;
+    uint64_t be = hton64(_d.a);
+    memcpy(p, &be, 8);
+    return p + 8;
+  }
+} ;
+
+/*
+  A read-only look at one AMF0 value where it sits in memory (a metadata tag in a mapped
+  input file, say), for when building the AMFData tree for it would be a waste: keys and
+  strings are read in place, containers are stepped over without decoding anything in them,
+  and only values somebody actually wants get materialize()d. Everything is bounds checked
+  against the end of the data and throws end_of_buffer, like serialized_buffer does.
+*/
+class AMFView {
+public:
+  AMFView() : p(NULL), end(NULL) {}
+  // The value whose type byte is at _p; the data it's in ends at _end
+  AMFView(const char* _p, const char* _end) : p(_p), end(_end) {}
+
+  bool valid() const { return p != NULL; }
+  const char* data() const { return p; }
+  AMFType typeID() const { return (AMFType)(need(p, 1)[0] & 0xff); }
+
+  // Bytes the value takes up, type byte included; the same as serializedSize() of what it decodes to
+  size_t serializedSize() const { return skip(p, end) - p; }
+  // The value stored right after this one
+  AMFView following() const { return AMFView(skip(p, end), end); }
+
+  double asDouble() const {
+    switch (typeID()) {
+      case AMF_TYPE_DOUBLE: return get_double(need(p + 1, 8));
+      case AMF_TYPE_BOOLEAN: return need(p + 1, 1)[0] ? 1.0 : 0.0;
+      default: return materialize()->asDouble();
+    }
+  }
+
+  // Strings, without copying them out
+  const char* stringData() const { expect(AMF_TYPE_STRING); return need(p + 3, stringSize()); }
+  size_t stringSize() const { expect(AMF_TYPE_STRING); return get_u16(need(p + 1, 2)); }
+  bool isString(const char* s) const {
+    size_t l = strlen(s);
+    return typeID() == AMF_TYPE_STRING && stringSize() == l && memcmp(stringData(), s, l) == 0;
+  }
+
+  // Walks the members of an object or mixed array. Like AMFMixedArray, an array whose data
+  // ends between two members just ends there.
+  class member_iterator {
+  public:
+    member_iterator(const char* _p, const char* _end) : p(_p), end(_end) { read(); }
+
+    bool done() const { return k == NULL; }
+    const char* key() const { return k; }
+    size_t keySize() const { return klen; }
+    bool keyIs(const char* s) const { return strlen(s) == klen && memcmp(k, s, klen) == 0; }
+    AMFView value() const { return AMFView(k + klen, end); }
+    void next() {
+      p = skip(k + klen, end);
+      read();
+    }
+
+  protected:
+    void read() {
+      k = NULL;
+      klen = 0;
+      if ((end - p) < 2) return;
+      size_t l = get_u16(p);
+      if (l == 0) return; // done
+      k = AMFView::need(p + 2, l, end);
+      klen = l;
+    }
+
+    const char* p;
+    const char* end;
+    const char* k;
+    size_t klen;
+  } ;
+
+  member_iterator members() const {
+    AMFType t = typeID();
+    if (t == AMF_TYPE_OBJECT) return member_iterator(p + 1, end);
+    if (t == AMF_TYPE_MIXED_ARRAY) return member_iterator(need(p + 1, 4) + 4, end); // skip nkeys
+    throw std::runtime_error("AMFView::members: not an object or mixed array");
+  }
+
+  // The member called key, or an invalid view if there's no such member
+  AMFView find(const char* key) const {
+    for (member_iterator mi = members(); ! mi.done(); mi.next()) {
+      if (mi.keyIs(key)) return mi.value();
+    }
+    return AMFView();
+  }
+
+  // Strict arrays. One that's all doubles (which is how AMFDoubleArray writes them) is a run of
+  // fixed-size elements, so any element of it can be read without walking the ones before it.
+  size_t arraySize() const { expect(AMF_TYPE_ARRAY); return get_u32(need(p + 1, 4)); }
+  bool isDoubleArray() const {
+    size_t n = arraySize();
+    const char* q = need(p + 5, n * 9);
+    for (size_t i = 0; i < n; ++i) {
+      if (q[i * 9] != AMF_TYPE_DOUBLE) return false;
+    }
+    return true;
+  }
+  // Only for arrays isDoubleArray() is true of
+  double doubleAt(size_t i) const { return get_double(p + 5 + (i * 9) + 1); }
+
+  // Decode the value (and everything in it) into AMFData objects
+  shared_ptr<AMFData> materialize() const {
+    serialized_buffer buf(p, end - p);
+    return AMFData::construct(buf);
+  }
+
+protected:
+  // n bytes starting at at, if the data goes that far
+  const char* need(const char* at, size_t n) const { return need(at, n, end); }
+  static const char* need(const char* at, size_t n, const char* end) {
+    if (at > end || (size_t)(end - at) < n) throw end_of_buffer(n, at > end ? 0 : (end - at));
+    return at;
+  }
+  void expect(AMFType t) const {
+    if (typeID() != t) throw std::runtime_error("AMFView: value isn't of the type asked for");
+  }
+
+  static uint16_t get_u16(const char* q) { return ((q[0] & 0xff) << 8) | (q[1] & 0xff); }
+  static uint32_t get_u32(const char* q) {
+    return ((uint32_t)(q[0] & 0xff) << 24) | ((q[1] & 0xff) << 16) | ((q[2] & 0xff) << 8) | (q[3] & 0xff);
+  }
+  static double get_double(const char* q) {
+    union {
+      uint64_t a;
+      double b;
+    } _d;
+    memcpy(&_d.a, q, 8);
+    _d.a = hton64(_d.a);
+    return _d.b;
+  }
+
+  // Where the value at q ends
+  static const char* skip(const char* q, const char* end) {
+    char typeID = need(q, 1, end)[0];
+    switch (typeID & 0xff) {
+      case AMF_TYPE_DOUBLE:
+        return need(q + 1, 8, end) + 8;
+      case AMF_TYPE_BOOLEAN:
+        return need(q + 1, 1, end) + 1;
+      case AMF_TYPE_STRING:
+        return need(q + 3, get_u16(need(q + 1, 2, end)), end) + get_u16(q + 1);
+      case AMF_TYPE_OBJECT:
+        return skip_members(q + 1, end);
+      case AMF_TYPE_NULL:
+      case AMF_TYPE_UNDEFINED:
+      case AMF_TYPE_UNSUPPORTED:
+        return q + 1;
+      case AMF_TYPE_MIXED_ARRAY:
+        return skip_members(need(q + 1, 4, end) + 4, end);
+      case AMF_TYPE_ARRAY: {
+        uint32_t len = get_u32(need(q + 1, 4, end));
+        q += 5;
+        for (uint32_t s = 0; s < len; ++s) q = skip(q, end);
+        return q;
+      }
+      case AMF_TYPE_DATE:
+        return need(q + 1, 10, end) + 10;
+    }
+    char errbuf[64];
+    sprintf(errbuf, "AMFView: unknown typeID 0x%02x\n", (typeID & 0xff));
+    throw std::runtime_error(errbuf);
+  }
+  static const char* skip_members(const char* q, const char* end) {
+    while ((end - q) >= 2) {
+      size_t l = get_u16(q);
+      if (l == 0) return need(q, 3, end) + 3; // empty key + terminator byte
+      q = skip(need(q + 2, l, end) + l, end);
+    }
+    return end; // ran out between members; see member_iterator
+  }
+
+  const char* p;
+  const char* end;
+} ;
+
+// A value copied out of an AMFView still encoded, so keeping it costs a memcpy however big
+// it is; it only gets decoded if something asks what's in it.
+class AMFEncoded : public AMFData {
+public:
+  AMFEncoded(const AMFView& v) : bytes(v.data(), v.data() + v.serializedSize()) {}
+
+  virtual AMFType typeID() const { return (AMFType)(bytes[0] & 0xff); }
+  virtual double asDouble() const { return view().asDouble(); }
+  virtual bool asBool() const { return decoded().asBool(); }
+  virtual string asString() const { return decoded().asString(); }
+  virtual void dump(FILE* f) const { decoded().dump(f); }
+  virtual void dumpJSON(FILE* f) const { decoded().dumpJSON(f); }
+  virtual char* encode(char* p) const {
+    memcpy(p, &bytes[0], bytes.size());
+    return p + bytes.size();
+  }
+  virtual size_t serializedSize() const { return bytes.size(); }
+
+  AMFView view() const { return AMFView(&bytes[0], &bytes[0] + bytes.size()); }
+
+protected:
+  const AMFData& decoded() const {
+    if (! d) d = view().materialize();
+    return *d;
+  }
+
+  vector<char> bytes;
+  mutable shared_ptr<AMFData> d;
 } ;
 
 class AMFDouble : public AMFData {
@@ -90,15 +412,13 @@ public:
     sprintf(buf, "%f", d);
     return string(buf);
   }
-  virtual void write(fout& fp) const {
-    union {
-      uint64_t a;
-      double b;
-    } _d;
-    _d.b = d;
-    fp.putc(AMF_TYPE_DOUBLE);
-    fp.write<uint64_t>(hton64(_d.a));
+  virtual void dump(FILE* f) const { fprintf(f, "%f", d); }
+  virtual void dumpJSON(FILE* f) const { dump_json_double(f, d); }
+  virtual char* encode(char* p) const {
+    *(p++) = AMF_TYPE_DOUBLE;
+    return put_double_be(p, d);
   }
+  virtual size_t serializedSize() const { return 9; }
 
   double d;
 } ;
@@ -116,10 +436,14 @@ public:
   virtual string asString() const {
     return string(d ? "true" : "false");
   }
-  virtual void write(fout& fp) const {
-    fp.putc(AMF_TYPE_BOOLEAN);
-    fp.putc(d ? 0x01 : 0x00);
+  virtual void dump(FILE* f) const { fputs(d ? "true" : "false", f); }
+  virtual void dumpJSON(FILE* f) const { dump(f); }
+  virtual char* encode(char* p) const {
+    *(p++) = AMF_TYPE_BOOLEAN;
+    *(p++) = d ? 0x01 : 0x00;
+    return p;
   }
+  virtual size_t serializedSize() const { return 2; }
 
   bool d;
 } ;
@@ -137,12 +461,16 @@ public:
   virtual double asDouble() const { return d.size() ? 1.0 : 0.0; }
   virtual bool asBool() const { return d.size(); }
   virtual string asString() const { return d; }
-
-  virtual void write(fout& fp) const {
-    fp.putc(AMF_TYPE_STRING);
-    fp.write<uint16_t>(htons(d.size()));
-    fp.write(d.data(), d.size());
+  virtual void dump(FILE* f) const { fwrite(d.data(), 1, d.size(), f); }
+  virtual void dumpJSON(FILE* f) const { dump_json_string(f, d.data(), d.size()); }
+
+  virtual char* encode(char* p) const {
+    *(p++) = AMF_TYPE_STRING;
+    p = put_u16_be(p, d.size());
+    memcpy(p, d.data(), d.size());
+    return p + d.size();
   }
+  virtual size_t serializedSize() const { return 3 + d.size(); }
 
   string d;
 } ;
@@ -150,29 +478,35 @@ public:
 class AMFNull : public AMFData {
 public:
   AMFNull() {}
-  AMFNull(serialized_buffer& buf) { }
+  AMFNull(serialized_buffer&) { }
 
   virtual AMFType typeID() const { return AMF_TYPE_NULL; }
   virtual double asDouble() const { return 0.0; }
   virtual bool asBool() const { return false; }
   virtual string asString() const { return "NULL"; }
-  virtual void write(fout& fp) const {
-    fp.putc(AMF_TYPE_NULL);
+  virtual void dump(FILE* f) const { fputs("NULL", f); }
+  virtual char* encode(char* p) const {
+    *(p++) = AMF_TYPE_NULL;
+    return p;
   }
+  virtual size_t serializedSize() const { return 1; }
 } ;
 
 class AMFUndefined : public AMFData {
 public:
   AMFUndefined() {}
-  AMFUndefined(serialized_buffer& buf) { }
+  AMFUndefined(serialized_buffer&) { }
 
   virtual AMFType typeID() const { return AMF_TYPE_UNDEFINED; }
   virtual double asDouble() const { return 0.0; }
   virtual bool asBool() const { return false; }
   virtual string asString() const { return "UNDEFINED"; }
-  virtual void write(fout& fp) const {
-    fp.putc(AMF_TYPE_UNDEFINED);
+  virtual void dump(FILE* f) const { fputs("UNDEFINED", f); }
+  virtual char* encode(char* p) const {
+    *(p++) = AMF_TYPE_UNDEFINED;
+    return p;
   }
+  virtual size_t serializedSize() const { return 1; }
 } ;
 
 class AMFMixedArray : public AMFData {
@@ -187,13 +521,27 @@ public:
   virtual AMFType typeID() const { return AMF_TYPE_MIXED_ARRAY; }
   virtual double asDouble() const { return dmap.size(); }
   virtual bool asBool() const { return dmap.size(); }
-  virtual string asString() const {
-    string d("{ \n");
+  virtual string asString() const { return dumped(); }
+  virtual void dump(FILE* f) const {
+    fputs("{ \n", f);
+    for (map<string, shared_ptr<AMFData> >::const_iterator dmi = dmap.begin(); dmi != dmap.end(); ++dmi) {
+      fputs("  ", f);
+      fwrite(dmi->first.data(), 1, dmi->first.size(), f);
+      fputs(": ", f);
+      dmi->second->dump(f);
+      fputc('\n', f);
+    }
+    fputc('}', f);
+  }
+  virtual void dumpJSON(FILE* f) const {
+    fputc('{', f);
     for (map<string, shared_ptr<AMFData> >::const_iterator dmi = dmap.begin(); dmi != dmap.end(); ++dmi) {
-      d = d + string("  ") + dmi->first + string(": ") + dmi->second->asString() + string("\n");
+      if (dmi != dmap.begin()) fputc(',', f);
+      dump_json_string(f, dmi->first.data(), dmi->first.size());
+      fputc(':', f);
+      dmi->second->dumpJSON(f);
     }
-    d += string("}");
-    return d;
+    fputc('}', f);
   }
   // copies the contents of the 'right' array into this one
   // if overwrite is true, right's contents overwrite existing keys in this array
@@ -202,7 +550,13 @@ public:
     if (right->typeID() != AMF_TYPE_MIXED_ARRAY) {
       throw std::runtime_error("AMFMixedArray::merge: attempt to merge with something other than a MixedArray");
     }
-    AMFMixedArray* r = static_cast<AMFMixedArray*>(&(*right));
+    AMFMixedArray* r = dynamic_cast<AMFMixedArray*>(&(*right));
+    if (! r) { // still encoded
+      const AMFEncoded* e = dynamic_cast<const AMFEncoded*>(&(*right));
+      if (! e) throw std::runtime_error("AMFMixedArray::merge: don't know how to read this array");
+      merge(e->view(), overwrite);
+      return;
+    }
     for (map<string, shared_ptr<AMFData> >::const_iterator ri = r->dmap.begin(); ri != r->dmap.end(); ++ri) {
       if (overwrite) {
         dmap[ri->first] = ri->second; // straight assignment operator overwrites existing keys.
@@ -213,23 +567,43 @@ public:
     }
   }
 
-  virtual void write(fout& fp) const {
-    fp.putc(AMF_TYPE_MIXED_ARRAY);
-    fp.write<uint32_t>(htonl(dmap.size())); // mixed arrays have this size thing, but objects don't
-    _write(fp);
+  // The same, straight from the encoded array: the members that get copied are kept still
+  // encoded (see AMFEncoded), and the ones that don't are never looked at past their keys
+  void merge(const AMFView& right, bool overwrite) {
+    if (right.typeID() != AMF_TYPE_MIXED_ARRAY) {
+      throw std::runtime_error("AMFMixedArray::merge: attempt to merge with something other than a MixedArray");
+    }
+    // Find all the members before taking any, so a damaged array doesn't get half merged
+    vector<pair<string, AMFView> > kept;
+    for (AMFView::member_iterator mi = right.members(); ! mi.done(); mi.next()) {
+      string k(mi.key(), mi.keySize());
+      if (overwrite || dmap.find(k) == dmap.end()) kept.push_back(std::make_pair(k, mi.value()));
+    }
+    for (size_t s = 0; s < kept.size(); ++s) {
+      shared_ptr<AMFData> v(new AMFEncoded(kept[s].second));
+      if (overwrite) {
+        dmap[kept[s].first] = v;
+      }
+      else {
+        dmap.insert(std::make_pair(kept[s].first, v)); // the first of any duplicate keys wins, as in _construct
+      }
+    }
+  }
+
+  virtual char* encode(char* p) const {
+    *(p++) = AMF_TYPE_MIXED_ARRAY;
+    p = put_u32_be(p, dmap.size()); // mixed arrays have this size thing, but objects don't
+    return _encode(p);
   }
+  virtual size_t serializedSize() const { return 5 + _serializedSize(); }
 
   map<string, shared_ptr<AMFData> > dmap;
 protected:
+  // An array cut short throws end_of_buffer, like anything else that runs off the end of the
+  // data, for whoever's reading it to report
   void _construct(serialized_buffer& buf) {
     do {
-      uint16_t l = 0;
-      try {
-        l = buf.get_u16_be();
-      } catch (const end_of_buffer& e) {
-        printf("Error deserializing an array element: %s. Array may be incomplete.\n", e.what());
-        return;
-      }
+      uint16_t l = buf.get_u16_be();
       if (l == 0) break; // done
       string k = string(buf.get_bytes(l), l);
       dmap.insert(std::make_pair(k, AMFData::construct(buf)));
@@ -237,14 +611,23 @@ protected:
     buf.get_u8(); // eat terminator byte (0x09)
   }
   // writing routines common between this and AMFObject
-  void _write(fout& fp) const {
+  char* _encode(char* p) const {
+    for (map<string, shared_ptr<AMFData> >::const_iterator dmi = dmap.begin(); dmi != dmap.end(); ++dmi) {
+      p = put_u16_be(p, dmi->first.size());
+      memcpy(p, dmi->first.data(), dmi->first.size());
+      p += dmi->first.size();
+      p = dmi->second->encode(p);
+    }
+    p = put_u16_be(p, 0);
+    *(p++) = 0x09; // writeback terminator byte
+    return p;
+  }
+  size_t _serializedSize() const {
+    size_t sz = 3; // empty key + terminator byte
     for (map<string, shared_ptr<AMFData> >::const_iterator dmi = dmap.begin(); dmi != dmap.end(); ++dmi) {
-      fp.write<uint16_t>(htons(dmi->first.size()));
-      fp.write(dmi->first.data(), dmi->first.size());
-      dmi->second->write(fp);
+      sz += 2 + dmi->first.size() + dmi->second->serializedSize();
     }
-    fp.write<uint16_t>(0);
-    fp.putc(0x09); // writeback terminator byte
+    return sz;
   }
 } ;
 
@@ -255,10 +638,11 @@ public:
     _construct(buf);
   }
   virtual AMFType typeID() const { return AMF_TYPE_OBJECT; }
-  virtual void write(fout& fp) const {
-    fp.putc(AMF_TYPE_OBJECT);
-    _write(fp);
+  virtual char* encode(char* p) const {
+    *(p++) = AMF_TYPE_OBJECT;
+    return _encode(p);
   }
+  virtual size_t serializedSize() const { return 1 + _serializedSize(); }
 } ;
 
 class AMFArray : public AMFData {
@@ -274,25 +658,81 @@ public:
   virtual AMFType typeID() const { return AMF_TYPE_ARRAY; }
   virtual double asDouble() const { return dmap.size(); }
   virtual bool asBool() const { return dmap.size(); }
-  virtual string asString() const {
-    string d("{ \n");
+  virtual string asString() const { return dumped(); }
+  virtual void dump(FILE* f) const {
+    fputs("{ \n", f);
+    for (size_t s = 0; s < dmap.size(); ++s) {
+      fputs("  ", f);
+      dmap[s]->dump(f);
+      fputc('\n', f);
+    }
+    fputc('}', f);
+  }
+  virtual void dumpJSON(FILE* f) const {
+    fputc('[', f);
     for (size_t s = 0; s < dmap.size(); ++s) {
-      d = d + string("  ") + dmap[s]->asString() + string("\n");
+      if (s) fputc(',', f);
+      dmap[s]->dumpJSON(f);
     }
-    d += string("}");
-    return d;
+    fputc(']', f);
   }
 
-  virtual void write(fout& fp) const {
-    fp.putc(AMF_TYPE_ARRAY);
-    fp.write<uint32_t>(htonl(dmap.size()));
+  virtual char* encode(char* p) const {
+    *(p++) = AMF_TYPE_ARRAY;
+    p = put_u32_be(p, dmap.size());
     for (size_t s = 0; s < dmap.size(); ++s) {
-      dmap[s]->write(fp);
+      p = dmap[s]->encode(p);
     }
+    return p;
+  }
+  virtual size_t serializedSize() const {
+    size_t sz = 5;
+    for (size_t s = 0; s < dmap.size(); ++s) {
+      sz += dmap[s]->serializedSize();
+    }
+    return sz;
   }
   vector<shared_ptr<AMFData> > dmap;
 } ;
 
+// An array of doubles (AMF0 strict array on the wire, like AMFArray) kept as plain doubles
+// instead of an AMFDouble apiece; used for the keyframe indices, which get big.
+class AMFDoubleArray : public AMFData {
+public:
+  AMFDoubleArray(size_t n = 0) : d(n, 0.0) {}
+
+  virtual AMFType typeID() const { return AMF_TYPE_ARRAY; }
+  virtual double asDouble() const { return d.size(); }
+  virtual bool asBool() const { return d.size(); }
+  virtual string asString() const { return dumped(); }
+  virtual void dump(FILE* f) const {
+    fputs("{ \n", f);
+    for (size_t s = 0; s < d.size(); ++s) fprintf(f, "  %f\n", d[s]);
+    fputc('}', f);
+  }
+  virtual void dumpJSON(FILE* f) const {
+    fputc('[', f);
+    for (size_t s = 0; s < d.size(); ++s) {
+      if (s) fputc(',', f);
+      dump_json_double(f, d[s]);
+    }
+    fputc(']', f);
+  }
+
+  virtual char* encode(char* p) const {
+    *(p++) = AMF_TYPE_ARRAY;
+    p = put_u32_be(p, d.size());
+    for (size_t s = 0; s < d.size(); ++s) {
+      *(p++) = AMF_TYPE_DOUBLE;
+      p = put_double_be(p, d[s]);
+    }
+    return p;
+  }
+  virtual size_t serializedSize() const { return 5 + (9 * d.size()); }
+
+  vector<double> d;
+} ;
+
 class AMFDate:  public AMFData {
 public:
   AMFDate() {
@@ -311,6 +751,14 @@ public:
   virtual AMFType typeID() const { return AMF_TYPE_DATE; }
   virtual double asDouble() const { return (double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0); }
   virtual bool asBool() const { return (tv.tv_sec != 0); }
+  // as an ISO 8601 UTC time
+  virtual void dumpJSON(FILE* f) const {
+    struct tm tmbuf;
+    time_t t = tv.tv_sec;
+    gmtime_r(&t, &tmbuf);
+    fprintf(f, "\"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ\"", tmbuf.tm_year + 1900, tmbuf.tm_mon + 1, tmbuf.tm_mday,
+            tmbuf.tm_hour, tmbuf.tm_min, tmbuf.tm_sec, (int)(tv.tv_usec / 1000));
+  }
   virtual string asString() const {
     char buf[256];
     struct tm tmbuf;
@@ -327,17 +775,13 @@ public:
     return string(buf);
   }
 
-  virtual void write(fout& fp) const {
-    fp.putc(AMF_TYPE_DATE);
-    // get milliseconds since the epoch
-    union {
-      uint64_t a;
-      double b;
-    } _d;
-    _d.b = (static_cast<double>(tv.tv_sec) * 1000.0) + (static_cast<double>(tv.tv_usec) / 1000.0);
-    fp.write<uint64_t>(hton64(_d.a));
-    fp.write<int16_t>(htons(tz.tz_minuteswest));
+  virtual char* encode(char* p) const {
+    *(p++) = AMF_TYPE_DATE;
+    // milliseconds since the epoch
+    p = put_double_be(p, (static_cast<double>(tv.tv_sec) * 1000.0) + (static_cast<double>(tv.tv_usec) / 1000.0));
+    return put_u16_be(p, tz.tz_minuteswest);
   }
+  virtual size_t serializedSize() const { return 11; }
 
   struct timeval tv;
   struct timezone tz;
@@ -346,13 +790,16 @@ public:
 class AMFUnsupported : public AMFData {
 public:
   AMFUnsupported() {}
-  AMFUnsupported(serialized_buffer& buf) { }
+  AMFUnsupported(serialized_buffer&) { }
 
   virtual AMFType typeID() const { return AMF_TYPE_UNSUPPORTED; }
   virtual double asDouble() const { return 0.0; }
   virtual bool asBool() const { return false; }
   virtual string asString() const { return "UNSUPPORTED"; }
-  virtual void write(fout& fp) const {
-    fp.putc(AMF_TYPE_UNSUPPORTED);
+  virtual void dump(FILE* f) const { fputs("UNSUPPORTED", f); }
+  virtual char* encode(char* p) const {
+    *(p++) = AMF_TYPE_UNSUPPORTED;
+    return p;
   }
+  virtual size_t serializedSize() const { return 1; }
 } ;
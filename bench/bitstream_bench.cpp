@@ -0,0 +1,192 @@
+/*
+ * bitstream_bench.cpp
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ *
+ * Times bitstream against the bit-at-a-time reader it replaced, decoding the same
+ * mix of fixed-width fields and Exp-Golomb codes that SPS and slice headers are
+ * made of, and checks that both decode the same values.
+ *
+ * usage: bitstream_bench [codes] [passes]
+ */
+
+#include "../bitstream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <vector>
+
+// The reader bitstream used to be, for comparison
+class bytewise_bitstream {
+public:
+  bytewise_bitstream(serialized_buffer* _buffer) : buffer(_buffer), current_byte(0), last_used_bit(0) {}
+
+  uint32_t get_bits(uint8_t nbits) {
+    uint32_t result = 0;
+    while (nbits) {
+      result = result << 1 | get_bit();
+      --nbits;
+    }
+    return result;
+  }
+
+  uint8_t get_bit() {
+    if (! last_used_bit) {
+      current_byte = buffer->get_u8();
+      last_used_bit = 8;
+    }
+    --last_used_bit;
+    return ((current_byte & (1 << last_used_bit)) >> last_used_bit) & 1;
+  }
+
+  uint32_t get_golomb_ue() {
+    uint32_t leading_zeros = 0;
+    while (! get_bit()) ++leading_zeros;
+    return ((1 << leading_zeros) | get_bits(leading_zeros)) - 1;
+  }
+
+protected:
+  serialized_buffer* buffer;
+  uint8_t current_byte;
+  uint8_t last_used_bit;
+};
+
+class bit_writer {
+public:
+  bit_writer() : acc(0), nacc(0) {}
+
+  void put_bits(uint32_t v, unsigned nbits) {
+    while (nbits--) {
+      acc = (acc << 1) | ((v >> nbits) & 1);
+      if (++nacc == 8) {
+        bytes.push_back((char) acc);
+        acc = 0;
+        nacc = 0;
+      }
+    }
+  }
+  void put_golomb_ue(uint32_t v) {
+    uint32_t code = v + 1;
+    unsigned bits = 0;
+    while ((code >> bits) > 1) ++bits;
+    put_bits(0, bits);
+    put_bits(code, bits + 1);
+  }
+  void finish() {
+    while (nacc) put_bits(0, 1);
+    for (int i = 0; i < 8; ++i) bytes.push_back(0); // so neither reader runs out
+  }
+
+  std::vector<char> bytes;
+  uint32_t acc;
+  unsigned nacc;
+};
+
+// Insert emulation prevention bytes, as an encoder would in a NAL unit
+static std::vector<char> escape(const std::vector<char>& rbsp) {
+  std::vector<char> r;
+  unsigned zeros = 0;
+  for (size_t i = 0; i < rbsp.size(); ++i) {
+    uint8_t b = rbsp[i];
+    if (zeros >= 2 && b <= 3) {
+      r.push_back(3);
+      zeros = 0;
+    }
+    r.push_back(b);
+    zeros = b ? 0 : zeros + 1;
+  }
+  return r;
+}
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+// Each field is a fixed-width field (widths[i] > 0) or an Exp-Golomb code (widths[i] == 0)
+template <class reader>
+static uint64_t decode(reader& r, const std::vector<uint8_t>& widths, std::vector<uint32_t>* out) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < widths.size(); ++i) {
+    uint32_t v = widths[i] ? r.get_bits(widths[i]) : r.get_golomb_ue();
+    sum += v;
+    if (out) (*out)[i] = v;
+  }
+  return sum;
+}
+
+int main(int argc, char* argv[]) {
+  size_t ncodes = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+  int passes = (argc > 2) ? atoi(argv[2]) : 10;
+
+  // Mostly small codes with the odd big one and a sprinkling of flags and 8 bit fields,
+  // with plenty of zero bytes so the escaped stream has emulation prevention bytes to drop
+  srandom(1);
+  std::vector<uint8_t> widths(ncodes);
+  std::vector<uint32_t> values(ncodes);
+  bit_writer w;
+  for (size_t i = 0; i < ncodes; ++i) {
+    long k = random() % 16;
+    if (k < 3) {
+      widths[i] = (k == 0) ? 8 : 1;
+      values[i] = random() & ((1 << widths[i]) - 1);
+      if (k == 0 && random() % 4 == 0) values[i] = 0;
+      w.put_bits(values[i], widths[i]);
+    } else {
+      widths[i] = 0;
+      values[i] = (k == 15) ? (random() % 100000) : (random() % (1 << (k / 3)));
+      w.put_golomb_ue(values[i]);
+    }
+  }
+  w.finish();
+  std::vector<char> escaped = escape(w.bytes);
+  printf("%zu fields in %zu bytes (%zu escaped), %d passes\n", ncodes, w.bytes.size(), escaped.size(), passes);
+
+  // Both readers have to get back what went in
+  std::vector<uint32_t> got(ncodes);
+  {
+    serialized_buffer buf(&w.bytes[0], w.bytes.size());
+    bytewise_bitstream r(&buf);
+    decode(r, widths, &got);
+    if (got != values) { printf("FAILED: bytewise reader decoded the wrong values\n"); return 1; }
+  }
+  {
+    bitstream r(&w.bytes[0], w.bytes.size());
+    decode(r, widths, &got);
+    if (got != values) { printf("FAILED: bitstream decoded the wrong values\n"); return 1; }
+  }
+  {
+    bitstream r(&escaped[0], escaped.size(), true);
+    decode(r, widths, &got);
+    if (got != values) { printf("FAILED: bitstream decoded the wrong values from the escaped stream\n"); return 1; }
+  }
+
+  uint64_t sum = 0;
+  double t0 = now();
+  for (int p = 0; p < passes; ++p) {
+    serialized_buffer buf(&w.bytes[0], w.bytes.size());
+    bytewise_bitstream r(&buf);
+    sum += decode(r, widths, NULL);
+  }
+  double t1 = now();
+  for (int p = 0; p < passes; ++p) {
+    bitstream r(&w.bytes[0], w.bytes.size());
+    sum += decode(r, widths, NULL);
+  }
+  double t2 = now();
+  for (int p = 0; p < passes; ++p) {
+    bitstream r(&escaped[0], escaped.size(), true);
+    sum += decode(r, widths, NULL);
+  }
+  double t3 = now();
+
+  double n = (double) ncodes * passes;
+  printf("bytewise_bitstream:   %8.2f ns/field\n", (t1 - t0) * 1e9 / n);
+  printf("bitstream:            %8.2f ns/field (%.1fx)\n", (t2 - t1) * 1e9 / n, (t1 - t0) / (t2 - t1));
+  printf("bitstream (escaped):  %8.2f ns/field (%.1fx)\n", (t3 - t2) * 1e9 / n, (t1 - t0) / (t3 - t2));
+  printf("(checksum %llu)\n", (unsigned long long) sum);
+  return 0;
+}
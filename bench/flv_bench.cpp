@@ -0,0 +1,439 @@
+/*
+ * flv_bench.cpp
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ *
+ * Microbenchmarks for the pieces every file goes through: serialized_buffer reads,
+ * bitstream Exp-Golomb decoding, AMF construct/encode/write of a big onMetaData
+ * (50000 keyframes), fout write throughput, the tag header scan, and -recover's search
+ * for tag headers through damaged data. Everything runs
+ * on synthetic data made from a fixed seed, so numbers from two builds compare.
+ * Each benchmark runs once to warm up and then repeats times; the best and median
+ * times are reported, and the best is the one to compare.
+ *
+ * usage: flv_bench [repeats] [name...]
+ *   With names, only the benchmarks whose names start with one of them are run.
+ */
+
+#include "../flvhint.h"
+#include "../bitstream.h"
+#include "../resync.h"
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+// A deterministic generator, so the data doesn't depend on the C library's random()
+class lcg {
+public:
+  lcg(uint64_t seed) : s(seed) {}
+  uint32_t next() {
+    s = s * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)(s >> 33);
+  }
+  uint32_t below(uint32_t n) { return next() % n; }
+
+protected:
+  uint64_t s;
+};
+
+class benchmark {
+public:
+  benchmark(const char* _name, const char* _unit) : name(_name), unit(_unit), items(0), bytes(0) {}
+  virtual ~benchmark() {}
+
+  virtual void setup() {}
+  // One pass over the data; returns something that depends on all of it, so the
+  // compiler can't leave any of it out
+  virtual uint64_t pass() = 0;
+  virtual void teardown() {}
+
+  const char* name;
+  const char* unit; // what items counts
+  uint64_t items; // per pass
+  uint64_t bytes; // per pass, for the MB/s column (0 if it doesn't mean anything)
+};
+
+// Fields of assorted widths, read back in the same mix they were written
+class buffer_bench : public benchmark {
+public:
+  buffer_bench() : benchmark("serialized_buffer", "field") {}
+
+  virtual void setup() {
+    lcg r(1);
+    size_t nfields = 4000000;
+    widths.resize(nfields);
+    for (size_t i = 0; i < nfields; ++i) {
+      static const uint8_t w[6] = { 1, 2, 3, 4, 8, 8 };
+      widths[i] = w[r.below(6)];
+      for (int b = 0; b < widths[i]; ++b) data.push_back((char)r.next());
+    }
+    items = nfields;
+    bytes = data.size();
+  }
+
+  virtual uint64_t pass() {
+    serialized_buffer buf(&data[0], data.size());
+    uint64_t sum = 0;
+    for (size_t i = 0; i < widths.size(); ++i) {
+      switch (widths[i]) {
+      case 1: sum += buf.get_u8(); break;
+      case 2: sum += buf.get_u16_be(); break;
+      case 3: sum += buf.get_u24_be(); break;
+      case 4: sum += buf.get_u32_be(); break;
+      default: sum += (uint64_t)buf.get_double_be(); break;
+      }
+    }
+    return sum;
+  }
+
+protected:
+  vector<uint8_t> widths;
+  vector<char> data;
+};
+
+// Exp-Golomb codes the sizes SPS and slice header fields come in
+class golomb_bench : public benchmark {
+public:
+  golomb_bench() : benchmark("bitstream_golomb", "code") {}
+
+  virtual void setup() {
+    lcg r(2);
+    size_t ncodes = 4000000;
+    uint64_t acc = 0;
+    unsigned nacc = 0;
+    for (size_t i = 0; i < ncodes; ++i) {
+      uint32_t k = r.below(16);
+      uint32_t v = (k == 15) ? r.below(100000) : r.below(1 << (k / 3));
+      uint32_t code = v + 1;
+      unsigned len = 0;
+      while ((code >> len) > 1) ++len;
+      // len zeros, then the len + 1 bits of code
+      for (int b = (int)(2 * len); b >= 0; --b) {
+        acc = (acc << 1) | ((b <= (int)len) ? ((code >> b) & 1) : 0);
+        if (++nacc == 8) {
+          data.push_back((char)acc);
+          acc = 0;
+          nacc = 0;
+        }
+      }
+    }
+    if (nacc) data.push_back((char)(acc << (8 - nacc)));
+    data.resize(data.size() + 8, 0); // so the reader doesn't run out
+    items = ncodes;
+    bytes = data.size();
+  }
+
+  virtual uint64_t pass() {
+    bitstream b(&data[0], data.size());
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < items; ++i) sum += b.get_golomb_ue();
+    return sum;
+  }
+
+protected:
+  vector<char> data;
+};
+
+// An onMetaData like the one write_flv() writes for a long file
+static shared_ptr<AMFMixedArray> make_metadata(size_t nkeyframes) {
+  shared_ptr<AMFMixedArray> meta(new AMFMixedArray());
+  static const char* flags[] = { "hasAudio", "hasVideo", "hasCuePoints", "hasMetadata", "canSeekToEnd", "hasKeyframes" };
+  for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); ++i) meta->dmap[flags[i]] = shared_ptr<AMFData>(new AMFBoolean(true));
+  static const char* numbers[] = { "duration", "framerate", "videodatarate", "audiodatarate", "videosize", "audiosize", "totalframes",
+                                   "lasttimestamp", "datasize", "width", "height", "videocodecid", "audiocodecid", "audiosamplerate" };
+  for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); ++i) meta->dmap[numbers[i]] = shared_ptr<AMFData>(new AMFDouble(12345.678 * (i + 1)));
+  meta->dmap["metadatacreator"] = shared_ptr<AMFData>(new AMFString("flvtool++ (Facebook, Motion project, dweatherford)"));
+  meta->dmap["encoder"] = shared_ptr<AMFData>(new AMFString("Lavf58.29.100"));
+
+  shared_ptr<AMFDoubleArray> times(new AMFDoubleArray(nkeyframes)), positions(new AMFDoubleArray(nkeyframes));
+  for (size_t i = 0; i < nkeyframes; ++i) {
+    times->d[i] = i * 2.002;
+    positions->d[i] = 1000.0 + i * 58213.0;
+  }
+  shared_ptr<AMFObject> keyframes(new AMFObject());
+  keyframes->dmap["times"] = times;
+  keyframes->dmap["filepositions"] = positions;
+  meta->dmap["keyframes"] = keyframes;
+  return meta;
+}
+
+#define BENCH_KEYFRAMES 50000
+
+class amf_construct_bench : public benchmark {
+public:
+  amf_construct_bench() : benchmark("amf_construct", "metadata") {}
+
+  virtual void setup() {
+    shared_ptr<AMFMixedArray> meta = make_metadata(BENCH_KEYFRAMES);
+    encoded.resize(meta->serializedSize());
+    meta->encode(&encoded[0]);
+    items = 1;
+    bytes = encoded.size();
+  }
+
+  virtual uint64_t pass() {
+    serialized_buffer buf(&encoded[0], encoded.size());
+    shared_ptr<AMFData> d = AMFData::construct(buf);
+    return (uint64_t)d->asDouble() + buf.remaining();
+  }
+
+protected:
+  vector<char> encoded;
+};
+
+class amf_encode_bench : public benchmark {
+public:
+  amf_encode_bench() : benchmark("amf_encode", "metadata") {}
+
+  virtual void setup() {
+    meta = make_metadata(BENCH_KEYFRAMES);
+    items = 1;
+    bytes = meta->serializedSize();
+  }
+
+  virtual uint64_t pass() {
+    vector<char> buf(meta->serializedSize());
+    char* end = meta->encode(&buf[0]);
+    return (end - &buf[0]) + buf[buf.size() / 2];
+  }
+
+protected:
+  shared_ptr<AMFMixedArray> meta;
+};
+
+// AMFData::write() into an fout, which is how the metadata used to reach the file
+class amf_write_bench : public amf_encode_bench {
+public:
+  amf_write_bench() { name = "amf_write"; }
+
+  virtual uint64_t pass() {
+    fout fp("/dev/null");
+    meta->write(fp);
+    uint64_t written = fp.tell();
+    fp.close();
+    return written;
+  }
+};
+
+// Tag-sized writes, each with its header written the way write_flv() rewrites one
+class fout_bench : public benchmark {
+public:
+  fout_bench() : benchmark("fout_write", "tag") {}
+
+  virtual void setup() {
+    lcg r(3);
+    uint64_t total = 0;
+    while (total < (256 << 20)) {
+      uint32_t len = (r.below(4) == 0) ? (2000 + r.below(40000)) : (100 + r.below(400));
+      sizes.push_back(len);
+      total += 11 + len + 4;
+    }
+    payload.resize(64 * 1024, 'x');
+    items = sizes.size();
+    bytes = total;
+  }
+
+  virtual uint64_t pass() {
+    fout fp("/dev/null");
+    for (size_t i = 0; i < sizes.size(); ++i) {
+      fp.putc((i & 1) ? 8 : 9);
+      fp.write_u24_be(sizes[i]);
+      fp.write_u24_be(i * 40);
+      fp.putc(0);
+      fp.write_u24_be(0);
+      fp.write(&payload[0], sizes[i]);
+      fp.write_u24_be(0);
+      fp.putc(11 + sizes[i]);
+    }
+    uint64_t written = fp.tell();
+    fp.close();
+    return written;
+  }
+
+protected:
+  vector<uint32_t> sizes;
+  vector<char> payload;
+};
+
+// A synthetic FLV: H.264 video with a keyframe every 50 frames, and AAC audio
+static void make_flv(vector<char>& flv, size_t size) {
+  lcg r(4);
+  static const char header[13] = { 'F', 'L', 'V', 0x01, 0x05, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00 };
+  flv.assign(header, header + 13);
+  uint32_t ts = 0;
+  for (size_t n = 0; flv.size() < size; ++n) {
+    bool video = (n % 3) != 2;
+    uint32_t len = video ? (((n % 150) == 0) ? (20000 + r.below(20000)) : (500 + r.below(6000))) : (200 + r.below(200));
+    char tag[16] = { (char)(video ? 9 : 8), (char)(len >> 16), (char)(len >> 8), (char)len,
+                     (char)(ts >> 16), (char)(ts >> 8), (char)ts, (char)(ts >> 24), 0, 0, 0,
+                     (char)(video ? (((n % 150) == 0) ? 0x17 : 0x27) : 0xaf), 1, 0, 0, 0 };
+    flv.insert(flv.end(), tag, tag + 16);
+    flv.resize(flv.size() + len - 5, (char)(n & 0xff));
+    uint32_t tag_size = 11 + len;
+    char postfix[4] = { (char)(tag_size >> 24), (char)(tag_size >> 16), (char)(tag_size >> 8), (char)tag_size };
+    flv.insert(flv.end(), postfix, postfix + 4);
+    if (video) ts += 40;
+  }
+}
+
+#define BENCH_FLV_SIZE (256 << 20)
+
+// The tag header walk on its own: check_tag() and the header fields, tag to tag
+class tag_walk_bench : public benchmark {
+public:
+  tag_walk_bench() : benchmark("tag_walk", "tag") {}
+
+  virtual void setup() {
+    make_flv(flv, BENCH_FLV_SIZE);
+    bytes = flv.size();
+    items = pass() & 0xffffffff;
+  }
+
+  virtual uint64_t pass() {
+    const char* p = &flv[0] + 13;
+    const char* end = &flv[0] + flv.size();
+    uint64_t ntags = 0, sum = 0;
+    while (p < end && check_tag(p, end) == TAG_OK) {
+      uint32_t tag_length = peek_uint24(p + 1);
+      sum += peek_uint24(p + 4) + tag_index::content_flags(p[0], tag_length, p + 11);
+      p += 11 + tag_length + 4;
+      ++ntags;
+    }
+    return (sum << 32) + ntags;
+  }
+
+protected:
+  vector<char> flv;
+};
+
+// The whole scan pass, as hint_job runs it (single-threaded), on the same FLV in a
+// temporary file, which is in the page cache by the time it's timed
+class scan_bench : public benchmark {
+public:
+  scan_bench() : benchmark("hint_scan", "tag"), nul(NULL) {}
+
+  virtual void setup() {
+    vector<char> flv;
+    make_flv(flv, BENCH_FLV_SIZE);
+    const char* tmpdir = getenv("TMPDIR");
+    filename = string(tmpdir ? tmpdir : "/tmp") + "/flv_bench.XXXXXX";
+    int fd = mkstemp(&filename[0]);
+    if (fd == -1 || ::write(fd, &flv[0], flv.size()) != (ssize_t)flv.size()) throw std::runtime_error("can't write " + filename);
+    ::close(fd);
+    nul = fopen("/dev/null", "w");
+    opts.scan_threads = 1;
+    opts.nodump = true;
+    bytes = flv.size();
+    items = pass() & 0xffffffff;
+  }
+
+  virtual uint64_t pass() {
+    hint_job job(opts, nul);
+    shared_ptr<input_source> src = job.index_input(filename.c_str());
+    uint64_t ntags = job.tags().size();
+    src->close();
+    return ntags;
+  }
+
+  virtual void teardown() {
+    unlink(filename.c_str());
+    if (nul) fclose(nul);
+  }
+
+protected:
+  hint_options opts;
+  string filename;
+  FILE* nul;
+};
+
+// -recover's search for the next tag header, through data that hasn't got any (the worst case)
+class resync_bench : public benchmark {
+public:
+  resync_bench() : benchmark("resync_search", "MB") {}
+
+  virtual void setup() {
+    lcg r(5);
+    junk.resize(BENCH_FLV_SIZE);
+    for (size_t i = 0; i < junk.size(); i += 4) {
+      uint32_t v = r.next();
+      memcpy(&junk[i], &v, 4);
+    }
+    bytes = junk.size();
+    items = bytes >> 20;
+  }
+
+  virtual uint64_t pass() {
+    const char* end = &junk[0] + junk.size();
+    uint64_t ncandidates = 0, sum = 0;
+    for (const char* p = next_tag_candidate(&junk[0], end); p != end; p = next_tag_candidate(p + 1, end)) {
+      sum += p - &junk[0];
+      ++ncandidates;
+    }
+    return (sum << 16) + ncandidates;
+  }
+
+protected:
+  vector<char> junk;
+};
+
+int main(int argc, char* argv[]) {
+  int repeats = (argc > 1) ? atoi(argv[1]) : 7;
+  if (repeats < 1) repeats = 1;
+  vector<string> only(argv + std::min(argc, 2), argv + argc);
+
+  vector<shared_ptr<benchmark> > benches;
+  benches.push_back(shared_ptr<benchmark>(new buffer_bench()));
+  benches.push_back(shared_ptr<benchmark>(new golomb_bench()));
+  benches.push_back(shared_ptr<benchmark>(new amf_construct_bench()));
+  benches.push_back(shared_ptr<benchmark>(new amf_encode_bench()));
+  benches.push_back(shared_ptr<benchmark>(new amf_write_bench()));
+  benches.push_back(shared_ptr<benchmark>(new fout_bench()));
+  benches.push_back(shared_ptr<benchmark>(new tag_walk_bench()));
+  benches.push_back(shared_ptr<benchmark>(new scan_bench()));
+  benches.push_back(shared_ptr<benchmark>(new resync_bench()));
+
+  printf("%-18s %14s %14s %16s %10s\n", "benchmark", "best", "median", "per item", "MB/s");
+  for (size_t b = 0; b < benches.size(); ++b) {
+    benchmark& bench = *benches[b];
+    bool wanted = only.empty();
+    for (size_t i = 0; i < only.size(); ++i) {
+      if (strncmp(bench.name, only[i].c_str(), only[i].size()) == 0) wanted = true;
+    }
+    if (! wanted) continue;
+
+    try {
+      bench.setup();
+      uint64_t check = bench.pass();
+      vector<double> times;
+      for (int r = 0; r < repeats; ++r) {
+        double t0 = now();
+        uint64_t c = bench.pass();
+        times.push_back(now() - t0);
+        if (c != check) throw std::runtime_error("a pass came out different from the first one");
+      }
+      bench.teardown();
+      std::sort(times.begin(), times.end());
+      double best = times[0], median = times[times.size() / 2];
+      char per_item[64], rate[32] = "-";
+      double per = best / bench.items;
+      if (per >= 1e-3) snprintf(per_item, sizeof(per_item), "%.2f ms/%s", per * 1e3, bench.unit);
+      else if (per >= 1e-6) snprintf(per_item, sizeof(per_item), "%.2f us/%s", per * 1e6, bench.unit);
+      else snprintf(per_item, sizeof(per_item), "%.2f ns/%s", per * 1e9, bench.unit);
+      if (bench.bytes) snprintf(rate, sizeof(rate), "%.1f", bench.bytes / best / 1e6);
+      printf("%-18s %11.3f ms %11.3f ms %16s %10s\n", bench.name, best * 1e3, median * 1e3, per_item, rate);
+    } catch (std::exception& e) {
+      bench.teardown();
+      printf("%-18s FAILED: %s\n", bench.name, e.what());
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -7,55 +7,136 @@
 
 #pragma once
 #include "serialized_buffer.h"
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
+/*
+  MSB-first bit reader for codec headers. Bits are taken from a 64-bit cache that's
+  refilled a word at a time, and Exp-Golomb codes are decoded by counting the
+  leading zeros of the cache in one go instead of a bit at a time.
+
+  H.264 NAL unit payloads (rbsp = true) have an emulation prevention byte inserted
+  after every 00 00 that would otherwise be followed by a byte <= 03; those are
+  dropped as the bytes are read, so callers see the RBSP itself. Reading past the
+  end of the data throws end_of_buffer, like serialized_buffer does.
+*/
 class bitstream {
 public:
-  bitstream(serialized_buffer* _buffer) : buffer(_buffer), current_byte(0), last_used_bit(0) {}
+  bitstream(const char* _p, size_t len, bool _rbsp = false) : p((const uint8_t*)_p), end((const uint8_t*)_p + len), rbsp(_rbsp), zeros(0), cache(0), cached(0) {}
 
-  // I'm sure this is really slow, but this isn't really in a critical path...
   uint32_t get_bits(uint8_t nbits) {
-    uint32_t result = 0;
     assert(nbits <= 32);
-    while (nbits) {
-      result = result << 1 | get_bit();
-      --nbits;
-    }
+    if (! nbits) return 0;
+    need(nbits);
+    uint32_t result = (uint32_t)(cache >> (64 - nbits));
+    consume(nbits);
     return result;
   }
 
   uint8_t get_bit() {
-    if (! last_used_bit) refill();
-    --last_used_bit;
-    return ((current_byte & (1 << last_used_bit)) >> last_used_bit) & 1;
+    need(1);
+    uint8_t result = (uint8_t)(cache >> 63);
+    consume(1);
+    return result;
+  }
+
+  void skip_bits(size_t nbits) {
+    while (nbits > 32) {
+      get_bits(32);
+      nbits -= 32;
+    }
+    get_bits(nbits);
   }
 
+  // Bits not read yet (counting any emulation prevention bytes still to come, in rbsp mode)
+  size_t bits_left() const { return cached + (8 * (end - p)); }
+
   uint32_t get_golomb_ue() {
+    if (cached < 32) refill();
+    // the usual case: the whole code is in the cache
+    if (cache) {
+      unsigned leading_zeros = __builtin_clzll(cache);
+      unsigned code_bits = (2 * leading_zeros) + 1;
+      if (leading_zeros < 32 && code_bits <= cached) {
+        uint32_t result = (uint32_t)((cache >> (64 - code_bits)) - 1);
+        consume(code_bits);
+        return result;
+      }
+    }
+    // near the end of the data, or a code too long to be valid
     uint32_t leading_zeros = 0;
-    while (! get_bit()) ++leading_zeros;
-    return ((1 << leading_zeros) | get_bits(leading_zeros)) - 1;
+    while (! get_bit()) {
+      if (++leading_zeros > 31) throw std::runtime_error("bitstream: Exp-Golomb code is longer than 32 bits");
+    }
+    return ((1U << leading_zeros) - 1) + get_bits(leading_zeros);
   }
 
   int32_t get_golomb_se() {
     uint32_t ue = get_golomb_ue();
-    if (! ue) return 0;
-    else if (ue & 1) return (ue >> 1);
-    else return (0 - (ue >> 1));
+    if (ue & 1) return (int32_t)((ue >> 1) + 1); // 1, 3, 5... are 1, 2, 3...
+    else return -(int32_t)(ue >> 1); // 0, 2, 4... are 0, -1, -2...
   }
 
 protected:
+  void need(unsigned nbits) {
+    if (cached < nbits) {
+      refill();
+      if (cached < nbits) throw end_of_buffer((nbits + 7) / 8, cached / 8);
+    }
+  }
+
+  void consume(unsigned nbits) {
+    cache = (nbits < 64) ? (cache << nbits) : 0;
+    cached -= nbits;
+  }
+
+  // Top the cache up to at least 56 bits, or to whatever is left of the data
   void refill() {
-    assert(last_used_bit == 0);
-    current_byte = buffer->get_u8();
-    last_used_bit = 8;
+    if ((end - p) >= 8) {
+      uint64_t w;
+      memcpy(&w, p, 8);
+      w = BE64(w);
+      // an emulation prevention byte has to be somewhere in the word for us to have to look
+      // at it a byte at a time; if there's no 03 in it, we can take it whole
+      if (! rbsp || ! has_byte_03(w)) {
+        unsigned take = (63 - cached) >> 3;
+        cache |= (w >> cached) & ~(~0ULL >> (cached + (take * 8)));
+        cached += take * 8;
+        p += take;
+        if (rbsp) { // keep track of the run of zero bytes we've just ended on
+          const uint8_t* last = p - 1;
+          zeros = last[0] ? 0 : (last[-1] ? 1 : 2);
+        }
+        return;
+      }
+    }
+    while (cached <= 56 && p < end) {
+      uint8_t b = *(p++);
+      if (rbsp && zeros >= 2 && b == 0x03) {
+        zeros = 0;
+        continue; // emulation prevention byte
+      }
+      zeros = b ? 0 : zeros + 1;
+      cache |= (uint64_t)b << (56 - cached);
+      cached += 8;
+    }
   }
 
-  serialized_buffer* buffer;
-  uint8_t current_byte;
-  uint8_t last_used_bit;
+  // Whether any byte of w is 0x03
+  static bool has_byte_03(uint64_t w) {
+    uint64_t x = w ^ 0x0303030303030303ULL;
+    return ((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL) != 0;
+  }
+
+  const uint8_t* p;
+  const uint8_t* end;
+  bool rbsp;
+  unsigned zeros; // zero bytes just read (for spotting emulation prevention bytes)
+  uint64_t cache; // the next bits of the stream, starting at the top bit; the bits below the cached ones are 0
+  unsigned cached;
 
 private:
   bitstream& operator=(const bitstream&);
   bitstream(const bitstream&);
 };
-
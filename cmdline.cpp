@@ -0,0 +1,130 @@
+/*
+ * cmdline.cpp
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#include "cmdline.h"
+#include <stdlib.h>
+
+bool command_line::parse(const vector<string>& args, string& error) {
+  for (size_t i = 0; i < args.size(); ++i) {
+    const string& a = args[i];
+    // options that take values; the values are checked for below
+    static const char* with_values[] = { "-tag", "-padding", "-segment", "-start", "-end", "-batch", "-j", "-scanthreads", "-input",
+                                         "-readahead", "-iodepth", "-outbuffer", "-outdepth", "-indexcache", "-daemon", "-http", NULL };
+    size_t nvalues = 0;
+    for (const char** w = with_values; *w; ++w) {
+      if (a == *w) nvalues = (a == "-tag") ? 2 : 1;
+    }
+    if (nvalues && (i + nvalues) >= args.size()) {
+      error = a + " needs " + ((nvalues == 2) ? "two values" : "a value");
+      return false;
+    }
+    const char* v = nvalues ? args[i + 1].c_str() : NULL;
+    bool job_option = true, option = true;
+
+    if (a == "-nomerge") {
+      opts.nomerge = true;
+    }
+    else if (a == "-nodump") {
+      opts.nodump = true;
+    }
+    else if (a == "-json") {
+      opts.json = true;
+    }
+    else if (a == "-stats") {
+      opts.stats = true;
+    }
+    else if (a == "-nometapackets") {
+      opts.nometapackets = true;
+    }
+    else if (a == "-strip") {
+      opts.strip = true;
+      opts.nometapackets = true;
+    }
+    else if (a == "-tag") {
+      opts.extra_tags.push_back(std::make_pair(args[i + 1], args[i + 2]));
+    }
+    else if (a == "-padding") {
+      opts.padding = strtoul(v, NULL, 10);
+    }
+    else if (a == "-segment") {
+      opts.segment_duration = strtod(v, NULL);
+    }
+    else if (a == "-start") {
+      opts.clip_start = strtod(v, NULL);
+    }
+    else if (a == "-end") {
+      opts.clip_end = strtod(v, NULL);
+    }
+    else if (a == "-concat") {
+      job_option = false;
+      concat = true;
+    }
+    else if (a == "-verify") {
+      job_option = false;
+      verify = true;
+    }
+    else if (a == "-inplace") {
+      opts.inplace = true;
+    }
+    else if (a == "-recover") {
+      opts.recover = true;
+    }
+    else if (a == "-batch") {
+      job_option = false;
+      manifest = v;
+    }
+    else if (a == "-j") {
+      job_option = false;
+      nthreads = strtol(v, NULL, 10);
+    }
+    else if (a == "-scanthreads") {
+      scan_threads = strtol(v, NULL, 10);
+    }
+    else if (a == "-input") {
+      if (! opts.input.parse_backend(v)) {
+        error = string("Unknown input backend ") + v;
+        return false;
+      }
+    }
+    else if (a == "-readahead") {
+      opts.input.block_size = strtoul(v, NULL, 10);
+    }
+    else if (a == "-iodepth") {
+      opts.input.depth = strtoul(v, NULL, 10);
+    }
+    else if (a == "-outbuffer") {
+      opts.output.buffer_size = strtoul(v, NULL, 10);
+    }
+    else if (a == "-outdepth") {
+      opts.output.depth = strtoul(v, NULL, 10);
+    }
+    else if (a == "-indexcache") {
+      opts.index_cache_dir = v;
+    }
+    else if (a == "-sidecar") {
+      opts.index_sidecar = true;
+    }
+    else if (a == "-daemon") {
+      job_option = false;
+      daemon_socket = v;
+    }
+    else if (a == "-http") {
+      job_option = false;
+      http_address = v;
+    }
+    else {
+      files.push_back(a);
+      job_option = false;
+      option = false;
+    }
+    if (option) options.push_back(a);
+    if (job_option) job_options.insert(job_options.end(), args.begin() + i, args.begin() + i + 1 + nvalues);
+    i += nvalues;
+  }
+  return true;
+}
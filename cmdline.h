@@ -0,0 +1,41 @@
+/*
+ * cmdline.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "flvhint.h"
+
+// Everything one flvtool++ command line asks for: the options for the hint_jobs it runs
+// and what to run them on. The daemon parses each request's arguments into one of these
+// too, so nothing about a request outlives it.
+struct command_line {
+  command_line() : concat(false), verify(false), nthreads(0), scan_threads(0) {}
+
+  // Fill this in from args (the command line without the program name). Returns false,
+  // with the reason in error, if an option is missing its value or has a bad one.
+  bool parse(const vector<string>& args, string& error);
+
+  // The input and output filenames, for a single input (output is NULL if there isn't one)
+  const char* input() const { return files.empty() ? NULL : files[0].c_str(); }
+  const char* output() const { return (files.size() < 2) ? NULL : files.back().c_str(); }
+  // -concat: every filename but the last is an input
+  vector<string> concat_inputs() const { return vector<string>(files.begin(), files.end() - std::min<size_t>(files.size(), 1)); }
+
+  hint_options opts;
+  vector<string> job_options; // the arguments that went into opts (and -scanthreads), for flvtool_set_options()
+  vector<string> options; // every option given, without its values
+  vector<string> files; // the filenames, in the order given
+  string manifest; // -batch
+  bool concat;
+  bool verify; // -verify: every filename is an input to check
+  long nthreads; // -j (0 if not given)
+  long scan_threads; // -scanthreads (0 if not given)
+  string daemon_socket; // -daemon
+  string http_address; // -http
+};
@@ -0,0 +1,210 @@
+/*
+ * codec_config.cpp
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#include "codec_config.h"
+#include "bitstream.h"
+
+void avc_decoder_config::parse(const char* p, size_t len) {
+  serialized_buffer buf(p, len);
+  if (buf.get_u8() != 1) throw std::runtime_error("unknown AVCDecoderConfigurationRecord version");
+  profile = buf.get_u8();
+  compatibility = buf.get_u8();
+  level = buf.get_u8();
+  nal_length_size = (buf.get_u8() & 0x03) + 1;
+  uint8_t nsps = buf.get_u8() & 0x1f;
+  for (uint8_t i = 0; i < nsps; ++i) {
+    uint16_t l = buf.get_u16_be();
+    sps.push_back(string(buf.get_bytes(l), l));
+  }
+  uint8_t npps = buf.get_u8();
+  for (uint8_t i = 0; i < npps; ++i) {
+    uint16_t l = buf.get_u16_be();
+    pps.push_back(string(buf.get_bytes(l), l));
+  }
+  // (the High profile chroma and bit depth fields that can follow are in the SPS too)
+}
+
+static void skip_scaling_list(bitstream& bs, int size) {
+  int32_t last_scale = 8, next_scale = 8;
+  for (int j = 0; j < size; ++j) {
+    if (next_scale != 0) {
+      int32_t delta_scale = bs.get_golomb_se();
+      next_scale = (last_scale + delta_scale + 256) % 256;
+    }
+    if (next_scale != 0) last_scale = next_scale;
+  }
+}
+
+void h264_sps::parse(const char* nal, size_t len) {
+  bitstream bs(nal, len, true);
+
+  if (bs.get_bit()) throw std::runtime_error("forbidden_zero_bit is 1");
+  bs.get_bits(2); // nal_ref_idc
+  if (bs.get_bits(5) != 7) throw std::runtime_error("not a seq_parameter_set NAL unit");
+
+  profile_idc = bs.get_bits(8);
+  bs.get_bits(8); // constraint_set[0-5]_flag, reserved_zero_2bits
+  level_idc = bs.get_bits(8);
+  bs.get_golomb_ue(); // seq_parameter_set_id
+
+  bool separate_colour_plane = false;
+  if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 || profile_idc == 244 || profile_idc == 44 ||
+      profile_idc == 83 || profile_idc == 86 || profile_idc == 118 || profile_idc == 128 || profile_idc == 138 ||
+      profile_idc == 139 || profile_idc == 134 || profile_idc == 135) {
+    chroma_format_idc = bs.get_golomb_ue();
+    if (chroma_format_idc > 3) throw std::runtime_error("bad chroma_format_idc");
+    if (chroma_format_idc == 3) separate_colour_plane = bs.get_bit();
+    bit_depth_luma = bs.get_golomb_ue() + 8;
+    bit_depth_chroma = bs.get_golomb_ue() + 8;
+    bs.get_bit(); // qpprime_y_zero_transform_bypass_flag
+    if (bs.get_bit()) { // seq_scaling_matrix_present_flag
+      int nlists = (chroma_format_idc != 3) ? 8 : 12;
+      for (int i = 0; i < nlists; ++i) {
+        if (bs.get_bit()) skip_scaling_list(bs, (i < 6) ? 16 : 64); // seq_scaling_list_present_flag[i]
+      }
+    }
+  }
+
+  bs.get_golomb_ue(); // log2_max_frame_num_minus4
+  uint32_t pic_order_cnt_type = bs.get_golomb_ue();
+  if (pic_order_cnt_type == 0) {
+    bs.get_golomb_ue(); // log2_max_pic_order_cnt_lsb_minus4
+  } else if (pic_order_cnt_type == 1) {
+    bs.get_bit(); // delta_pic_order_always_zero_flag
+    bs.get_golomb_se(); // offset_for_non_ref_pic
+    bs.get_golomb_se(); // offset_for_top_to_bottom_field
+    uint32_t num_ref_frames_in_pic_order_cnt_cycle = bs.get_golomb_ue();
+    if (num_ref_frames_in_pic_order_cnt_cycle > 255) throw std::runtime_error("bad num_ref_frames_in_pic_order_cnt_cycle");
+    for (uint32_t frame_idx = 0; frame_idx < num_ref_frames_in_pic_order_cnt_cycle; ++frame_idx) {
+      bs.get_golomb_se(); // offset_for_ref_frame
+    }
+  }
+  bs.get_golomb_ue(); // max_num_ref_frames
+  bs.get_bit(); // gaps_in_frame_num_value_allowed_flag
+
+  uint32_t pic_width_in_mbs = bs.get_golomb_ue() + 1;
+  uint32_t pic_height_in_map_units = bs.get_golomb_ue() + 1;
+  frame_mbs_only = bs.get_bit();
+  if (! frame_mbs_only) bs.get_bit(); // mb_adaptive_frame_field_flag
+  bs.get_bit(); // direct_8x8_inference_flag
+
+  uint32_t crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+  if (bs.get_bit()) { // frame_cropping_flag
+    crop_left = bs.get_golomb_ue();
+    crop_right = bs.get_golomb_ue();
+    crop_top = bs.get_golomb_ue();
+    crop_bottom = bs.get_golomb_ue();
+  }
+
+  // Crop offsets are in chroma samples, and in field lines for interlaced sources (H.264 7.4.2.1.1)
+  uint32_t field_factor = frame_mbs_only ? 1 : 2;
+  uint32_t crop_unit_x = 1, crop_unit_y = field_factor;
+  uint32_t chroma_array_type = separate_colour_plane ? 0 : chroma_format_idc;
+  if (chroma_array_type == 1) { // 4:2:0
+    crop_unit_x = 2;
+    crop_unit_y = 2 * field_factor;
+  } else if (chroma_array_type == 2) { // 4:2:2
+    crop_unit_x = 2;
+  }
+  width = (pic_width_in_mbs * 16) - (crop_unit_x * (crop_left + crop_right));
+  height = (pic_height_in_map_units * 16 * field_factor) - (crop_unit_y * (crop_top + crop_bottom));
+}
+
+const char* h264_sps::profile_name() const {
+  switch (profile_idc) {
+    case 66: return "Baseline";
+    case 77: return "Main";
+    case 88: return "Extended";
+    case 100: return "High";
+    case 110: return "High 10";
+    case 122: return "High 4:2:2";
+    case 244: return "High 4:4:4 Predictive";
+    case 44: return "CAVLC 4:4:4 Intra";
+  }
+  return "(unknown profile)";
+}
+
+static const uint32_t aac_sample_rates[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
+
+static uint32_t get_audio_object_type(bitstream& bs) {
+  uint32_t aot = bs.get_bits(5);
+  if (aot == 31) aot = 32 + bs.get_bits(6);
+  return aot;
+}
+
+static uint32_t get_sample_rate(bitstream& bs) {
+  uint32_t index = bs.get_bits(4);
+  if (index == 0x0f) return bs.get_bits(24);
+  if (index >= (sizeof(aac_sample_rates) / sizeof(aac_sample_rates[0]))) throw std::runtime_error("reserved samplingFrequencyIndex");
+  return aac_sample_rates[index];
+}
+
+void aac_audio_config::parse(const char* p, size_t len) {
+  bitstream bs(p, len);
+  object_type = get_audio_object_type(bs);
+  sample_rate = output_sample_rate = get_sample_rate(bs);
+  uint32_t channel_config = bs.get_bits(4);
+
+  // Explicit hierarchical signalling: the object type is SBR (or PS), and the real one comes after
+  bool explicit_sbr = false;
+  if (object_type == 5 || object_type == 29) {
+    explicit_sbr = sbr = true;
+    ps = (object_type == 29);
+    output_sample_rate = get_sample_rate(bs);
+    object_type = get_audio_object_type(bs);
+    if (object_type == 22) bs.get_bits(4); // extensionChannelConfiguration
+  }
+
+  switch (object_type) {
+    case 1: case 2: case 3: case 4: case 6: case 7: case 17: case 19: case 20: case 21: case 22: case 23: {
+      // GASpecificConfig
+      bs.get_bit(); // frameLengthFlag
+      if (bs.get_bit()) bs.get_bits(14); // dependsOnCoreCoder, coreCoderDelay
+      bool extension_flag = bs.get_bit();
+      if (channel_config == 0) {
+        // the layout is in a program_config_element; whoever wants it can run ffprobe
+        channels = 0;
+        return;
+      }
+      if (object_type == 6 || object_type == 20) bs.get_bits(3); // layerNr
+      if (extension_flag) {
+        if (object_type == 22) bs.get_bits(16); // numOfSubFrame, layer_length
+        if (object_type == 17 || object_type == 19 || object_type == 20 || object_type == 23) bs.get_bits(3); // resilience flags
+        bs.get_bit(); // extensionFlag3
+      }
+      break;
+    }
+  }
+  channels = (channel_config == 7) ? 8 : channel_config;
+
+  // Backward compatible signalling: SBR and PS announced in a sync extension after the core config
+  if (! explicit_sbr && bs.bits_left() >= 16 && bs.get_bits(11) == 0x2b7) {
+    if (get_audio_object_type(bs) == 5) {
+      sbr = bs.get_bit();
+      if (sbr) {
+        output_sample_rate = get_sample_rate(bs);
+        if (bs.bits_left() >= 12 && bs.get_bits(11) == 0x548) ps = bs.get_bit();
+      }
+    }
+  }
+  if (ps) channels = 2; // a mono core decodes to stereo
+}
+
+const char* aac_audio_config::profile_name() const {
+  if (ps) return "HE-AAC v2";
+  if (sbr) return "HE-AAC";
+  switch (object_type) {
+    case 1: return "AAC Main";
+    case 2: return "AAC LC";
+    case 3: return "AAC SSR";
+    case 4: return "AAC LTP";
+    case 23: return "AAC LD";
+    case 39: return "AAC ELD";
+  }
+  return "AAC";
+}
@@ -0,0 +1,60 @@
+/*
+ * codec_config.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include "common.h"
+
+/*
+  Parsers for the codec configuration that H.264 and AAC streams carry in their
+  sequence header tags (AVCPacketType 0 / AACPacketType 0), which is where the
+  real picture size, sample rate and channel count are. Malformed data throws
+  (end_of_buffer or std::runtime_error).
+*/
+
+// AVCDecoderConfigurationRecord (ISO 14496-15 5.2.4.1), the body of an AVC sequence header tag
+struct avc_decoder_config {
+  avc_decoder_config() : profile(0), compatibility(0), level(0), nal_length_size(4) {}
+
+  void parse(const char* p, size_t len);
+
+  uint8_t profile, compatibility, level;
+  uint8_t nal_length_size; // bytes in the length prefix of each NAL unit in AVCPacketType 1 tags
+  vector<string> sps, pps; // NAL units, header byte included
+};
+
+// What we want out of an H.264 seq_parameter_set_rbsp (ITU-T H.264 7.3.2.1.1)
+struct h264_sps {
+  h264_sps() : profile_idc(0), level_idc(0), chroma_format_idc(1), bit_depth_luma(8), bit_depth_chroma(8), frame_mbs_only(true), width(0), height(0) {}
+
+  // nal is a whole NAL unit (header byte included), still escaped
+  void parse(const char* nal, size_t len);
+  // e.g. "High"
+  const char* profile_name() const;
+
+  uint32_t profile_idc, level_idc;
+  uint32_t chroma_format_idc; // 0 = monochrome, 1 = 4:2:0, 2 = 4:2:2, 3 = 4:4:4
+  uint32_t bit_depth_luma, bit_depth_chroma;
+  bool frame_mbs_only; // progressive
+  uint32_t width, height; // cropped picture size in pixels
+};
+
+// AAC AudioSpecificConfig (ISO 14496-3 1.6.2.1), the body of an AAC sequence header tag
+struct aac_audio_config {
+  aac_audio_config() : object_type(0), sample_rate(0), channels(0), sbr(false), ps(false), output_sample_rate(0) {}
+
+  void parse(const char* p, size_t len);
+  // e.g. "HE-AAC"
+  const char* profile_name() const;
+
+  uint32_t object_type; // of the core codec: 2 is AAC LC
+  uint32_t sample_rate; // of the core codec
+  uint32_t channels; // 0 if the configuration is in a program_config_element (which we don't read)
+  bool sbr, ps; // spectral band replication (HE-AAC), parametric stereo (HE-AAC v2)
+  uint32_t output_sample_rate; // after SBR
+};
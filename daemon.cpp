@@ -0,0 +1,382 @@
+/*
+ * daemon.cpp
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#include "daemon.h"
+#include "cmdline.h"
+#include "flvhint.h"
+#include "verify.h"
+#include "workpool.h"
+#include <math.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int) {
+  stop_requested = 1;
+}
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+// Request latencies are counted in buckets by powers of 2: bucket i has the requests that
+// took less than 2^i ms (and more than half that), and the last one everything slower
+#define LATENCY_BUCKETS 20
+
+// What the daemon has done since it started, for the stats request
+class daemon_stats {
+public:
+  daemon_stats() : started(now()), requests(0), failed(0), active(0), input_bytes(0), busy_time(0), max_latency(0) {
+    pthread_mutex_init(&lock, NULL);
+    memset(latency_buckets, 0, sizeof(latency_buckets));
+  }
+  ~daemon_stats() { pthread_mutex_destroy(&lock); }
+
+  void begin() {
+    pthread_mutex_lock(&lock);
+    ++active;
+    pthread_mutex_unlock(&lock);
+  }
+
+  void end(const string& command, bool ok, uint64_t bytes, double latency) {
+    size_t bucket = 0;
+    while (bucket < (LATENCY_BUCKETS - 1) && (latency * 1000.0) >= (double)(1 << bucket)) ++bucket;
+    pthread_mutex_lock(&lock);
+    --active;
+    ++requests;
+    ++commands[command];
+    if (! ok) ++failed;
+    input_bytes += bytes;
+    busy_time += latency;
+    max_latency = std::max(max_latency, latency);
+    ++latency_buckets[bucket];
+    pthread_mutex_unlock(&lock);
+  }
+
+  void dumpJSON(FILE* f) {
+    pthread_mutex_lock(&lock);
+    double uptime = now() - started;
+    fprintf(f, "{\"uptime\":%.3f,\"requests\":%llu,\"failed\":%llu,\"active\":%u,\"commands\":{", uptime, (unsigned long long)requests, (unsigned long long)failed, active);
+    for (map<string, uint64_t>::const_iterator i = commands.begin(); i != commands.end(); ++i) {
+      fprintf(f, "%s\"%s\":%llu", (i == commands.begin()) ? "" : ",", i->first.c_str(), (unsigned long long)i->second);
+    }
+    // bytes_per_sec is over the daemon's lifetime, busy_bytes_per_sec over the time spent on requests
+    fprintf(f, "},\"input_bytes\":%llu,\"bytes_per_sec\":%.0f,\"busy_bytes_per_sec\":%.0f", (unsigned long long)input_bytes, uptime > 0 ? input_bytes / uptime : 0.0, busy_time > 0 ? input_bytes / busy_time : 0.0);
+    // the percentiles are the upper ends of the buckets they fall in
+    fprintf(f, ",\"latency\":{\"mean\":%.6f,\"max\":%.6f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f}}",
+            requests ? busy_time / requests : 0.0, max_latency, percentile(0.5), percentile(0.9), percentile(0.99));
+    pthread_mutex_unlock(&lock);
+  }
+
+protected:
+  // (called with the lock held)
+  double percentile(double p) const {
+    if (! requests) return 0;
+    uint64_t want = (uint64_t)ceil(p * requests), seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS - 1; ++i) {
+      seen += latency_buckets[i];
+      if (seen >= want) return (1 << i) / 1000.0;
+    }
+    return max_latency;
+  }
+
+  pthread_mutex_t lock;
+  double started;
+  uint64_t requests, failed;
+  unsigned active;
+  map<string, uint64_t> commands;
+  uint64_t input_bytes;
+  double busy_time, max_latency;
+  uint64_t latency_buckets[LATENCY_BUCKETS];
+
+private:
+  daemon_stats(const daemon_stats& _r); // noncopyable
+  daemon_stats& operator=(const daemon_stats& _r); // nonassignable
+} ;
+
+// The options a request may set (see daemon.h): what the job does, but not where else it
+// writes or how many threads and how much memory it takes
+static const char* request_options[] = { "-concat", "-end", "-indexcache", "-inplace", "-input", "-json", "-nodump", "-nomerge", "-nometapackets",
+                                         "-padding", "-recover", "-sidecar", "-start", "-stats", "-strip", "-tag", NULL };
+
+static bool request_option(const string& option) {
+  for (const char** o = request_options; *o; ++o) {
+    if (option == *o) return true;
+  }
+  return false;
+}
+
+// Everything a request asks for is in its own command_line and hint_job; only the
+// stats are shared between requests
+static string handle_request(const vector<string>& request, daemon_stats& stats) {
+  double t0 = now();
+  string command = request.empty() ? string() : request[0];
+  char* logbuf = NULL;
+  size_t loglen = 0;
+  FILE* log = open_memstream(&logbuf, &loglen);
+  char* resultbuf = NULL;
+  size_t resultlen = 0;
+  FILE* result = open_memstream(&resultbuf, &resultlen);
+  if (! log || ! result) {
+    if (log) fclose(log);
+    if (result) fclose(result);
+    free(logbuf);
+    free(resultbuf);
+    throw std::runtime_error("open_memstream failed");
+  }
+  // (asking for the stats doesn't count as a request in them)
+  bool counted = (command != "stats");
+  if (counted) stats.begin();
+  bool ok = false;
+  string error;
+  uint64_t input_bytes = 0;
+  string job_stats_json;
+
+  try {
+    if (command == "stats") {
+      stats.dumpJSON(result);
+    } else if (command == "hint" || command == "dump" || command == "probe" || command == "verify") {
+      vector<string> args(request.begin() + 1, request.end());
+      string cwd;
+      if (args.size() >= 2 && args[0] == "-cwd") {
+        cwd = args[1];
+        args.erase(args.begin(), args.begin() + 2);
+      }
+      command_line cmd;
+      if (! cmd.parse(args, error)) throw std::runtime_error(error);
+      for (size_t i = 0; i < cmd.options.size(); ++i) {
+        if (! request_option(cmd.options[i])) throw std::runtime_error(cmd.options[i] + " can't be used in a request");
+      }
+      if (cmd.files.empty()) throw std::runtime_error(command + " needs an input filename");
+      for (size_t i = 0; i < cmd.files.size(); ++i) {
+        if (cmd.files[i] == "-") throw std::runtime_error("the daemon can't read from stdin or write to stdout");
+        if (! cwd.empty() && ! cmd.files[i].empty() && cmd.files[i][0] != '/') cmd.files[i] = cwd + "/" + cmd.files[i];
+      }
+      if (! cwd.empty() && ! cmd.opts.index_cache_dir.empty() && cmd.opts.index_cache_dir[0] != '/') cmd.opts.index_cache_dir = cwd + "/" + cmd.opts.index_cache_dir;
+      // the pool keeps the CPUs busy with requests
+      cmd.opts.scan_threads = 1;
+      cmd.opts.json = true;
+      if (command == "probe") cmd.opts.nomerge = true;
+
+      vector<string> inputs = cmd.concat ? cmd.concat_inputs() : vector<string>(1, cmd.files[0]);
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        struct stat statbuf;
+        if (stat(inputs[i].c_str(), &statbuf) == 0) input_bytes += statbuf.st_size;
+      }
+
+      if (command == "verify") {
+        if (cmd.files.size() != 1) throw std::runtime_error("verify takes just an input filename");
+        verify_result r = verify_file(cmd.input(), cmd.opts, log);
+        r.dumpJSON(result, cmd.input());
+        if (! r.ok) throw std::runtime_error(r.problem);
+      } else {
+        hint_job job(cmd.opts, log);
+        job.dump = result;
+        if (command != "hint") {
+          if (cmd.files.size() != 1 || cmd.concat || cmd.opts.inplace) throw std::runtime_error(command + " takes just an input filename");
+          job.run(cmd.input(), NULL);
+        } else if (cmd.concat) {
+          if (cmd.files.size() < 2) throw std::runtime_error("-concat needs an output filename");
+          job.concat(cmd.concat_inputs(), cmd.output());
+        } else {
+          if (! cmd.output() && ! cmd.opts.inplace) throw std::runtime_error("hint needs an output filename (or -inplace)");
+          job.run(cmd.input(), cmd.output());
+        }
+        if (cmd.opts.stats) job_stats_json = job.stats.json();
+      }
+    } else {
+      throw std::runtime_error("unknown command \"" + command + "\" (hint, dump, probe, verify or stats)");
+    }
+    ok = true;
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+  fclose(log);
+  fclose(result);
+  double elapsed = now() - t0;
+  if (counted) {
+    bool known = (command == "hint" || command == "dump" || command == "probe" || command == "verify");
+    stats.end(known ? command : "other", ok, input_bytes, elapsed);
+  }
+
+  // the metadata dump ends with a newline
+  while (resultlen && resultbuf[resultlen - 1] == '\n') --resultlen;
+  char* responsebuf = NULL;
+  size_t responselen = 0;
+  FILE* response = open_memstream(&responsebuf, &responselen);
+  fprintf(response, "{\"ok\":%s,\"command\":", ok ? "true" : "false");
+  AMFString(command).dumpJSON(response);
+  if (! ok) {
+    fputs(",\"error\":", response);
+    AMFString(error).dumpJSON(response);
+  }
+  fprintf(response, ",\"elapsed\":%.6f", elapsed);
+  if (resultlen) {
+    fprintf(response, ",\"%s\":", (command == "stats" || command == "verify") ? command.c_str() : "metadata");
+    fwrite(resultbuf, 1, resultlen, response);
+  }
+  if (! job_stats_json.empty()) fprintf(response, ",\"job_stats\":%s", job_stats_json.c_str());
+  fputs(",\"log\":", response);
+  AMFString(string(logbuf, loglen)).dumpJSON(response);
+  fputc('}', response);
+  fclose(response);
+  string r(responsebuf, responselen);
+  free(logbuf);
+  free(resultbuf);
+  free(responsebuf);
+  return r;
+}
+
+// The next request on a client connection, answered on a pool thread. The connection goes
+// back to idle to wait for another, unless the client has gone away.
+class daemon_connection : public work_item {
+public:
+  daemon_connection(int _fd, daemon_stats& _stats, idle_connections& _idle) : fd(_fd), stats(_stats), idle(_idle) {}
+
+  virtual void run() {
+    string frame;
+    bool answered = false;
+    if (receive_frame(fd, frame, DAEMON_MAX_REQUEST)) {
+      // NUL-terminated strings; anything after the last NUL counts as one more
+      vector<string> request;
+      size_t start = 0;
+      while (start < frame.size()) {
+        size_t nul = frame.find('\0', start);
+        if (nul == string::npos) nul = frame.size();
+        request.push_back(frame.substr(start, nul - start));
+        start = nul + 1;
+      }
+      try {
+        answered = send_frame(fd, handle_request(request, stats));
+      } catch (const std::exception&) {
+        // out of memory or the like; drop the connection
+      }
+    }
+    if (answered) idle.put_back(fd);
+    else ::close(fd);
+    delete this;
+  }
+
+protected:
+  int fd;
+  daemon_stats& stats;
+  idle_connections& idle;
+} ;
+
+static work_item* new_daemon_connection(int fd, void* stats, idle_connections& idle) {
+  return new daemon_connection(fd, *static_cast<daemon_stats*>(stats), idle);
+}
+
+void serve_connections(int lfd, unsigned nthreads, connection_handler handler, void* context) {
+  // a client that hangs up before reading its response mustn't take us with it
+  signal(SIGPIPE, SIG_IGN);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  idle_connections idle;
+  vector<std::pair<int, time_t> > waiting; // connections waiting for a request, and since when
+  work_pool pool(nthreads);
+  while (! stop_requested) {
+    time_t t = time(NULL);
+    vector<int> returned = idle.take_returned();
+    for (size_t i = 0; i < returned.size(); ++i) waiting.push_back(std::make_pair(returned[i], t));
+
+    // wake up now and then to see if we've been asked to stop, and to time connections out
+    vector<struct pollfd> p(waiting.size() + 2);
+    p[0].fd = lfd;
+    p[1].fd = idle.wake_fd();
+    for (size_t i = 0; i < waiting.size(); ++i) p[i + 2].fd = waiting[i].first;
+    for (size_t i = 0; i < p.size(); ++i) {
+      p[i].events = POLLIN;
+      p[i].revents = 0;
+    }
+    if (poll(&p[0], p.size(), 1000) < 0) continue;
+    t = time(NULL);
+
+    // a connection with something to read (or that's been hung up) goes to the pool
+    size_t kept = 0;
+    for (size_t i = 0; i < waiting.size(); ++i) {
+      if (p[i + 2].revents) pool.submit(handler(waiting[i].first, context, idle));
+      else if ((t - waiting[i].second) >= DAEMON_IDLE_TIMEOUT) ::close(waiting[i].first);
+      else waiting[kept++] = waiting[i];
+    }
+    waiting.resize(kept);
+
+    if (p[0].revents & POLLIN) {
+      int cfd = accept(lfd, NULL, NULL);
+      if (cfd == -1) continue;
+      // once a request starts arriving, it has to keep arriving
+      struct timeval timeout;
+      timeout.tv_sec = DAEMON_READ_TIMEOUT;
+      timeout.tv_usec = 0;
+      setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      waiting.push_back(std::make_pair(cfd, t));
+    }
+  }
+  fprintf(stderr, "Stopping; finishing the requests in progress\n");
+  pool.wait();
+  for (size_t i = 0; i < waiting.size(); ++i) ::close(waiting[i].first);
+  // (and what the pool put back on its way out is closed with idle)
+}
+
+int run_daemon(const char* socket_path, unsigned nthreads) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", socket_path);
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (lfd == -1) {
+    fprintf(stderr, "Unable to create a socket: %s\n", strerror(errno));
+    return -1;
+  }
+  // A socket left behind by a daemon that didn't get to clean up is taken over; one
+  // that another daemon is still listening on isn't, and nor is anything that isn't a socket
+  struct stat statbuf;
+  if (stat(socket_path, &statbuf) == 0) {
+    if (! S_ISSOCK(statbuf.st_mode)) {
+      fprintf(stderr, "%s exists and isn't a socket\n", socket_path);
+      ::close(lfd);
+      return -1;
+    }
+    if (connect(lfd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+      fprintf(stderr, "Another daemon is already listening on %s\n", socket_path);
+      ::close(lfd);
+      return -1;
+    }
+    unlink(socket_path);
+    ::close(lfd);
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  }
+  if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(lfd, 64) != 0) {
+    fprintf(stderr, "Unable to listen on %s: %s\n", socket_path, strerror(errno));
+    ::close(lfd);
+    return -1;
+  }
+
+  fprintf(stderr, "flvtool++ daemon listening on %s (%u threads)\n", socket_path, nthreads);
+  daemon_stats stats;
+  serve_connections(lfd, nthreads, new_daemon_connection, &stats);
+  ::close(lfd);
+  unlink(socket_path);
+  stats.dumpJSON(stderr);
+  fputc('\n', stderr);
+  return 0;
+}
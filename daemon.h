@@ -0,0 +1,157 @@
+/*
+ * daemon.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "workpool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+  Daemon mode (-daemon socket): flvtool++ stays running, listening on a Unix domain
+  socket, and does what it's asked over any number of connections, several requests
+  at a time.
+
+  Everything on the wire is framed: a 4 byte big-endian length, then that many bytes.
+  A request is a command followed by its arguments, each one NUL-terminated:
+
+    hint [options] input output    hint a file, exactly as the command line would
+    dump [options] input           the metadata of a file, as flvtool++ input shows it
+    probe [options] input          what the tag stream itself says, ignoring any onMetaData in the file
+    verify input                   check the file's tag chain, as -verify does
+    stats                          the daemon's counters
+
+  The options are the command line's that say what the job does: -concat, -end, -indexcache,
+  -inplace, -input, -json, -nodump, -nomerge, -nometapackets, -padding, -recover, -sidecar,
+  -start, -stats, -strip and -tag. The rest (-segment, which names output files itself, the
+  ones that size threads and buffers, which are the daemon's to decide, and -batch, -daemon,
+  -http, -j and -verify) are refused. Filenames are relative to the daemon's working
+  directory, unless "-cwd dir" comes first. The response to each
+  request is a frame holding one JSON object:
+
+    {"ok":true,"command":"hint","elapsed":0.0123,"metadata":{...},"log":"..."}
+
+  with "error" when ok is false, "stats" or "verify" instead of "metadata" for those commands, and
+  the job's "job_stats" (see job_stats.h) as well if the request had -stats.
+  A connection can carry any number of requests one after the other; the daemon closes
+  it once the client hangs up, after DAEMON_IDLE_TIMEOUT seconds of waiting for one, or if
+  a request stops arriving partway for DAEMON_READ_TIMEOUT seconds.
+*/
+
+#define DAEMON_MAX_REQUEST (1024 * 1024)
+#define DAEMON_IDLE_TIMEOUT 60
+#define DAEMON_READ_TIMEOUT 10
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Serve requests on a Unix domain socket at socket_path, running up to nthreads of them at
+// once, until we get SIGINT or SIGTERM. Returns the exit status for main().
+int run_daemon(const char* socket_path, unsigned nthreads);
+
+// Where serve_connections() keeps connections between requests. Only a connection with
+// something to read is given to a pool thread, so clients that hold connections open
+// without sending anything don't tie up the pool. A work item that has answered a request
+// and wants to wait for another puts its connection back here, from any thread.
+class idle_connections {
+public:
+  idle_connections() {
+    pthread_mutex_init(&lock, NULL);
+    if (pipe(wake) != 0) throw std::runtime_error(string("pipe: ") + strerror(errno));
+    fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+  }
+  ~idle_connections() {
+    for (size_t i = 0; i < returned.size(); ++i) ::close(returned[i]);
+    ::close(wake[0]);
+    ::close(wake[1]);
+    pthread_mutex_destroy(&lock);
+  }
+
+  // Wait for fd's next request; fd belongs to serve_connections() again
+  void put_back(int fd) {
+    pthread_mutex_lock(&lock);
+    returned.push_back(fd);
+    pthread_mutex_unlock(&lock);
+    char c = 0;
+    while (::write(wake[1], &c, 1) < 0 && errno == EINTR) {}
+  }
+
+  // For serve_connections(): readable once something has been put back
+  int wake_fd() const { return wake[0]; }
+  // What's been put back since the last call
+  vector<int> take_returned() {
+    char buf[64];
+    while (::read(wake[0], buf, sizeof(buf)) > 0) {}
+    vector<int> r;
+    pthread_mutex_lock(&lock);
+    r.swap(returned);
+    pthread_mutex_unlock(&lock);
+    return r;
+  }
+
+protected:
+  pthread_mutex_t lock;
+  int wake[2];
+  vector<int> returned;
+
+private:
+  idle_connections(const idle_connections& _r); // noncopyable
+  idle_connections& operator=(const idle_connections& _r); // nonassignable
+} ;
+
+// Makes the work item that answers what a connection has sent. The item owns fd: it either
+// closes it or puts it back in idle. It deletes itself when it's done.
+typedef work_item* (*connection_handler)(int fd, void* context, idle_connections& idle);
+
+// Accept connections on the listening socket lfd and answer them on a pool of nthreads threads,
+// until we get SIGINT or SIGTERM. Requests being answered then are finished first. Connections
+// time out after DAEMON_IDLE_TIMEOUT seconds without sending anything, or after
+// DAEMON_READ_TIMEOUT seconds stalled partway through a request.
+void serve_connections(int lfd, unsigned nthreads, connection_handler handler, void* context);
+
+// Send and receive one frame; false if the connection broke (or, receiving, was closed
+// before a new frame started, or sent one bigger than max_size)
+inline bool send_frame(int fd, const string& payload) {
+  char len[4] = { (char)(payload.size() >> 24), (char)(payload.size() >> 16), (char)(payload.size() >> 8), (char)payload.size() };
+  string frame = string(len, 4) + payload;
+  const char* p = frame.data();
+  size_t left = frame.size();
+  while (left) {
+    ssize_t w = ::send(fd, p, left, MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    p += w;
+    left -= w;
+  }
+  return true;
+}
+
+inline bool receive_bytes(int fd, char* p, size_t len) {
+  while (len) {
+    ssize_t r = ::recv(fd, p, len, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    len -= r;
+  }
+  return true;
+}
+
+inline bool receive_frame(int fd, string& payload, size_t max_size) {
+  unsigned char len[4];
+  if (! receive_bytes(fd, (char*)len, 4)) return false;
+  size_t n = ((size_t)len[0] << 24) | (len[1] << 16) | (len[2] << 8) | len[3];
+  if (n > max_size) return false;
+  payload.resize(n);
+  return n == 0 || receive_bytes(fd, &payload[0], n);
+}
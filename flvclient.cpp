@@ -0,0 +1,56 @@
+/*
+ * flvclient
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ *
+ * Sends one request to a flvtool++ daemon (see daemon.h) and prints its response.
+ * Relative filenames are taken from the directory flvclient is run in. Exits 0 if
+ * the daemon says the request worked.
+ */
+
+#include "common.h"
+#include "daemon.h"
+#include <stdlib.h>
+#include <sys/un.h>
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    printf("usage: flvclient socket command [options] [filenames]\n");
+    printf("  commands: hint [options] input output, dump [options] input, probe [options] input, verify input, stats\n");
+    printf("  (the options are the flvtool++ ones that say what the job does; see daemon.h)\n");
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", argv[1]);
+    return -1;
+  }
+  strcpy(addr.sun_path, argv[1]);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "Unable to connect to %s: %s\n", argv[1], strerror(errno));
+    return -1;
+  }
+
+  string request = string(argv[2]) + '\0';
+  if (strcmp(argv[2], "stats") != 0) {
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd))) request += string("-cwd") + '\0' + cwd + '\0';
+  }
+  for (int i = 3; i < argc; ++i) request += string(argv[i]) + '\0';
+
+  string response;
+  if (! send_frame(fd, request) || ! receive_frame(fd, response, (size_t)-1)) {
+    fprintf(stderr, "The daemon at %s hung up without answering\n", argv[1]);
+    return -1;
+  }
+  ::close(fd);
+  printf("%s\n", response.c_str());
+  // the response always starts with "ok"
+  return (response.compare(0, 10, "{\"ok\":true") == 0) ? 0 : 1;
+}
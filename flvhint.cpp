@@ -0,0 +1,1709 @@
+/*
+ * flvhint.cpp
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#include "flvhint.h"
+#include "codec_config.h"
+#include "workpool.h"
+#include "resync.h"
+
+uint32_t hint_job::process_timestamp(char tag_type, char*& fptr, uint32_t& last_timestamp) {
+  uint32_t tag_timestamp = deserialize_uint24(fptr);
+  tag_timestamp |= ((*(fptr++)) & 0xff) << 24; // add upper 8 bits of the timestamp field from TimestampExtended
+  return fix_timestamp(tag_type, tag_timestamp, last_timestamp);
+}
+
+uint32_t hint_job::fix_timestamp(char tag_type, uint32_t tag_timestamp, uint32_t& last_timestamp) {
+  if (tag_timestamp < last_timestamp) {
+    if (((tag_timestamp & 0xff000000) == 0) && (last_timestamp & 0xfff00000)) {
+      // Looks like the file doesn't have the TimestampExtended field properly set.
+      if (! timestamp_warning_given) {
+        timestamp_warning_given = true;
+        fprintf(log, "WARNING: Fixing wrapped timestamps produced by an encoder that doesn't understand TimestampExtended\n");
+      }
+      uint32_t new_timestamp = tag_timestamp + (last_timestamp & 0xff000000);
+      if (new_timestamp < last_timestamp) new_timestamp += 0x1000000;
+      tag_timestamp = new_timestamp;
+      assert(tag_timestamp >= last_timestamp);
+    } else {
+      if (! timestamp_warning_given && (tag_type == 9 || tag_type == 18)) { // don't warn on tags that aren't video or audio...
+        fprintf(log, "WARNING: File has discontiguous timestamps that we don't know how to fix.\n");
+        timestamp_warning_given = true;
+      }
+    }
+  }
+
+  if (tag_type == 9) { // only track last timestamp for video frames
+    last_timestamp = std::max(tag_timestamp, last_timestamp);
+  }
+  return tag_timestamp;
+}
+
+// Files with less tag data than this aren't worth scanning in parallel
+#define PARALLEL_SCAN_MIN (64 * 1024 * 1024)
+
+// -recover looks for the tag stream again this much of the file at a time...
+#define RESYNC_WINDOW (1024 * 1024)
+// ...and only believes it's found it if this many tags in a row check out
+#define RESYNC_CHAIN 3
+
+// Tag runs shorter than this aren't worth a copy_file_range() syscall; buffer them instead.
+#define COPY_RANGE_MIN 65536
+
+// Runs that can't go through copy_file_range() are fetched and written in pieces of this size
+#define COPY_CHUNK (256 * 1024)
+
+// A spool file is copied to the output this much at a time, as its tag headers are walked
+#define SPOOL_COPY_RUN (16 * 1024 * 1024)
+
+// Copy a run of tags whose bytes are unchanged between the input and output files.
+static void copy_tag_run(fout& fp, input_source& src, uint64_t run_start, size_t run_length) {
+  if (run_length >= COPY_RANGE_MIN && src.fd != -1) {
+    fp.copy_range(src.fd, run_start, run_length);
+    return;
+  }
+  size_t copied = 0;
+  while (copied < run_length) {
+    size_t n = std::min<size_t>(run_length - copied, COPY_CHUNK);
+    fp.write(src.fetch(run_start + copied, n), n);
+    copied += n;
+  }
+}
+
+// The name of segment n: pattern with its one %d (or %0Nd) replaced by n, and %% by %.
+// Returns false if pattern has anything else after a %, or not exactly one %d.
+static bool segment_filename(const char* pattern, unsigned n, string& name) {
+  name.clear();
+  bool numbered = false;
+  for (const char* p = pattern; *p; ++p) {
+    if (*p != '%') {
+      name += *p;
+      continue;
+    }
+    ++p;
+    if (*p == '%') {
+      name += '%';
+      continue;
+    }
+    int width = 0;
+    if (*p == '0') {
+      ++p;
+      if (*p < '1' || *p > '9') return false;
+      width = *(p++) - '0';
+      if (*p >= '0' && *p <= '9') width = (width * 10) + (*(p++) - '0');
+    }
+    if (*p != 'd' || numbered) return false;
+    numbered = true;
+    char digits[32];
+    snprintf(digits, sizeof(digits), "%0*u", width, n);
+    name += digits;
+  }
+  return numbered;
+}
+
+void hint_job::count_tag(scan_totals& t, char tag_type, uint32_t tag_length, const char* body) {
+  if (tag_type == 9) { // video
+    t.hasVideo = true;
+    // Frame types: 1 = Keyframe, 2 = IFrame, 3 = Disposable IFrame
+    char frame_type = (body[0] >> 4) & 0x0f;
+    if (frame_type == 1) { // Keyframe
+      t.hasKeyframes = true;
+      ++t.keyframe_count;
+    }
+    t.total_video += (tag_length - 1); // accumulate video byte count, minus the codec_id_and_tag_type byte
+    ++t.vframe_count;
+  }
+  /*
+    Adobe FMS' API method Stream.record(...) sometimes generates
+    zero size audio tags at arbitrary position.
+  */
+  else if (tag_type == 8 && tag_length > 0) {
+    t.hasAudio = true;
+    t.total_audio += (tag_length); // accumulate audio byte count
+  }
+}
+
+void hint_job::inspect_tag(char tag_type, uint32_t tag_length, uint32_t tag_timestamp, char* body, size_t tag_offset) {
+  if (tag_type == 18) { // meta
+    // Read the tag in place: an existing onMetaData can be huge, and most of it
+    // (keyframe indices, mostly) gets regenerated anyway
+    try {
+      AMFView tagKey(body, body + tag_length);
+      AMFView d = tagKey.following();
+
+      if (tagKey.isString("onMetaData")) {
+        if (! opts.nomerge) {
+          fprintf(log, "Merging existing onMetaData tag\n");
+          onMetaData->merge(d, false);
+        }
+      }
+      else {
+        fputs("META tag (key ", log);
+        tagKey.materialize()->dump(log);
+        fputs("):\n", log);
+        d.materialize()->dump(log);
+        fputc('\n', log);
+      }
+    } catch (const std::exception& e) {
+      fprintf(log, "Error reading metadata tag: %s\n", e.what());
+    }
+  }
+  else if (tag_type == 9) { // video
+    if (! have_video_params) inspect_video(body, tag_length);
+  }
+  else if (tag_type == 8 && tag_length > 0) {
+    if (! have_audio_params) inspect_audio(body, tag_length);
+  }
+  else {
+    if (tag_length > 0) {
+      fprintf(log, "WARNING: Skipping unknown tag type %u (%u bytes, timestamp %u ms) at file offset 0x%zx\n", tag_type & 0xff, tag_length, tag_timestamp, tag_offset);
+    } else {
+      fprintf(log, "INFO: Skipping zero size audio tag at file offset 0x%zx\n", tag_offset);
+    }
+  }
+}
+
+void hint_job::inspect_video(char* body, uint32_t tag_length) {
+  char codec_id = (body[0] & 0x0f);
+  const char* codec;
+  char codec_buf[64];
+  int w = 0, h = 0;
+  switch (codec_id) {
+    case 2: codec = "H.263"; break;
+    case 3: codec = "SCREEN"; break;
+    case 4: codec = "VP6"; break;
+    case 6: codec = "SCREEN v2"; break;
+    case 7: codec = "H.264"; break;
+    default: codec = "(unknown)";
+   };
+  // Scrape width & height data from the video
+  char* vptr = body + 1; // skip the codec_id_and_frame_type byte
+  switch (codec_id) {
+    case 2: { // H.263
+      vptr += 3;
+      // yes, these flags and bytes span byte boundaries by ONE BIT (bastards)
+      char dim_flag = (((*vptr) & 0x03) << 1) + (((vptr[1]) & 0x80) >> 7);
+      ++vptr;
+      switch (dim_flag) {
+        case 0: // abs w/h encoded as uint8s
+          w = ((vptr[0] & 0x7f) << 1) + ((vptr[1] & 0x80) >> 7);
+          h = ((vptr[1] & 0x7f) << 1) + ((vptr[2] & 0x80) >> 7);
+          break;
+        case 1: // abs w/h encoded as uint16s (BE)
+          w  = (((vptr[0] & 0x7f) << 1) + ((vptr[1] & 0x80) >> 7)) << 8;
+          w += ((vptr[1] & 0x7f) << 1) + ((vptr[2] & 0x80) >> 7);
+          h  = (((vptr[2] & 0x7f) << 1) + ((vptr[3] & 0x80) >> 7)) << 8;
+          h += ((vptr[3] & 0x7f) << 1) + ((vptr[4] & 0x80) >> 7);
+          break;
+        case 2: w=352; h=288; break;
+        case 3: w=176; h=144; break;
+        case 4: w=128; h=96; break;
+        case 5: w=320; h=240; break;
+        case 6: w=160; h=120; break;
+      };
+      } break;
+    case 3: // SCREEN
+        // W & H encoded as 12-bit uints starting from halfway through the first byte
+        w  = ((*(vptr++)) & 0x0f) << 8;
+        w += ((*(vptr++)) & 0xff);
+        h  = ((*(vptr++)) & 0xff) << 4;
+        h  = ((*(vptr++)) & 0xf0) >> 4;
+      break;
+    case 4: // VP6.2
+        // [4] and [5] are the number of displayed macroblock rows/cols (respectively). Macrolocks are 16 px wide.
+        w = (vptr[4] & 0xff) * 16;
+        h = (vptr[5] & 0xff) * 16;
+        // and [0] is two adjustment values subtracted from w (high 4) and h (low 4)
+        h -= (vptr[0] & 0x0f);
+        w -= ((vptr[0] & 0xf0) >> 4);
+      break;
+    case 7: { // H.264
+      if (tag_length < 5) return;
+      uint8_t avc_packet_type = *(vptr++);
+      vptr += 3; // skip the composition time (SI24)
+      const char* vend = body + tag_length;
+      string sps;
+      try {
+        if (avc_packet_type == 0) {
+          avc_decoder_config avcc;
+          avcc.parse(vptr, vend - vptr);
+          avc_nal_length_size = avcc.nal_length_size;
+          if (! avcc.sps.empty()) sps = avcc.sps[0];
+        }
+        else if (avc_packet_type == 1) {
+          // no sequence header yet; look for an SPS sent in-band
+          const char* n = vptr;
+          while ((vend - n) >= avc_nal_length_size) {
+            uint32_t l = 0;
+            for (uint8_t i = 0; i < avc_nal_length_size; ++i) l = (l << 8) | (*(n++) & 0xff);
+            if (l > (uint32_t)(vend - n)) break;
+            if (l && (n[0] & 0x1f) == 7) {
+              sps.assign(n, l);
+              break;
+            }
+            n += l;
+          }
+        }
+        if (sps.empty()) return; // need seq_parameter_set_rbsp
+
+        h264_sps info;
+        info.parse(sps.data(), sps.size());
+        w = info.width;
+        h = info.height;
+        snprintf(codec_buf, sizeof(codec_buf), "H.264 %s@%u.%u", info.profile_name(), info.level_idc / 10, info.level_idc % 10);
+        codec = codec_buf;
+        onMetaData->dmap["avcprofile"] = shared_ptr<AMFData>(new AMFDouble(info.profile_idc));
+        onMetaData->dmap["avclevel"] = shared_ptr<AMFData>(new AMFDouble(info.level_idc));
+      } catch (const std::exception& e) {
+        fprintf(log, "AVC sequence header decode: %s\n", e.what());
+        return;
+      }
+      } break;
+  }
+  onMetaData->dmap["videocodecid"] = shared_ptr<AMFData>(new AMFDouble(codec_id));
+  // decode width & height based on video stream type
+  have_video_params = true;
+  fprintf(log, "Video: %dx%d %s\n", w, h, codec);
+  if (w) onMetaData->dmap["width"] = shared_ptr<AMFData>(new AMFDouble(w));
+  if (h) onMetaData->dmap["height"] = shared_ptr<AMFData>(new AMFDouble(h));
+}
+
+void hint_job::inspect_audio(char* body, uint32_t tag_length) {
+  char audio_format_byte = *body;
+  char audio_format = ((audio_format_byte >> 4) & 0x0f); 
+  int audio_rate = 0;
+  switch ((audio_format_byte >> 2) & 0x03) {
+    case 0: audio_rate =  5500; break;
+    case 1: audio_rate = 11000; break;
+    case 2: audio_rate = 22000; break;
+    case 3: audio_rate = 44100; break;
+  };
+  int audio_sample_size = (audio_format_byte & 0x02) ? 16 : 8; 
+  bool stereo = (audio_format_byte & 0x01);
+  if (audio_format == 4) {
+    // Special case for 16kHz Mono NellyMoser audio
+    audio_sample_size = 8;
+    audio_rate = 16000;
+    stereo = false;
+  } else if (audio_format == 5) {
+    // 8kHz Mono NellyMoser audio
+    audio_sample_size = 8;
+    audio_rate = 8000;
+    stereo = false;
+  }
+  // The flags byte always says 44kHz stereo for AAC; the sequence header has the real thing
+  const char* aac_profile = NULL;
+  uint32_t channels = 0;
+  if (audio_format == 10 && tag_length > 2 && body[1] == 0) {
+    try {
+      aac_audio_config asc;
+      asc.parse(body + 2, tag_length - 2);
+      audio_rate = asc.output_sample_rate;
+      if (asc.channels) {
+        channels = asc.channels;
+        stereo = (channels >= 2);
+        onMetaData->dmap["audiochannels"] = shared_ptr<AMFData>(new AMFDouble(channels));
+      }
+      onMetaData->dmap["aacaot"] = shared_ptr<AMFData>(new AMFDouble(asc.ps ? 29 : (asc.sbr ? 5 : asc.object_type)));
+      aac_profile = asc.profile_name();
+    } catch (const std::exception& e) {
+      fprintf(log, "AAC sequence header decode: %s\n", e.what());
+    }
+  }
+  onMetaData->dmap["audiocodecid"] = shared_ptr<AMFData>(new AMFDouble(audio_format));
+  onMetaData->dmap["audiosamplerate"] = shared_ptr<AMFData>(new AMFDouble(audio_rate));
+  onMetaData->dmap["audiosamplesize"] = shared_ptr<AMFData>(new AMFDouble(audio_sample_size));
+  onMetaData->dmap["stereo"] = shared_ptr<AMFData>(new AMFBoolean(stereo));
+  const char* audio_format_str = NULL;
+  switch (audio_format) {
+    case 0: audio_format_str = "Uncompressed"; break;
+    case 1: audio_format_str = "ADPCM"; break;
+    case 2: audio_format_str = "MP3"; break;
+    case 3: audio_format_str = "Linear PCM (little endian)"; break;
+    case 4: audio_format_str = "NellyMoser (16kHz Mono special case)"; break;
+    case 5: audio_format_str = "NellyMoser (8kHz Mono special case)"; break;
+    case 6: audio_format_str = "NellyMoser"; break;
+    case 7: audio_format_str = "G.711 A-law log PCM"; break;
+    case 8: audio_format_str = "G.711 mu-law log PCM"; break;
+    case 10: audio_format_str = "AAC"; break;
+    case 11: audio_format_str = "Speex"; break;
+    case 14: audio_format_str = "MP3 8 kHz"; break;
+  }
+  if (aac_profile) audio_format_str = aac_profile;
+  char layout[32];
+  if (channels > 2) snprintf(layout, sizeof(layout), "%u channels", channels);
+  else strcpy(layout, stereo ? "stereo" : "mono");
+  fprintf(log, "Audio: %dHz %dbit %s, codec ID %d (%s)\n", audio_rate, audio_sample_size, layout, audio_format, audio_format_str);
+  have_audio_params = true;
+}
+
+void hint_job::truncate_stream(tag_check why, const char* tag_start, uint64_t tag_offset, uint64_t& end) {
+  if (why == TAG_JUNK) {
+    fprintf(log, "WARNING: extra junk at end of file (%zu bytes' worth)\n", (size_t)(end - tag_offset));
+  } else {
+    fprintf(log, "WARNING: Tag of type %u (%u bytes) at 0x%zx extends past the end of the file; will truncate the stream here.\n", tag_start[0], peek_uint24(tag_start + 1), (size_t)tag_offset);
+  }
+  // Adjust the end of the data to the end of the previous tag for the tag copying process
+  end = tag_offset;
+}
+
+bool hint_job::tag_chain(input_source& src, uint64_t offset, uint64_t end, bool check_postfix, unsigned count) {
+  for (unsigned i = 0; i < count && offset != end; ++i) {
+    if ((end - offset) < 15) return false;
+    const char* p = src.fetch(offset, 11);
+    if (! tag_header_candidate(p)) return false;
+    uint32_t tag_length = peek_uint24(p + 1);
+    if ((end - offset) < (11 + (uint64_t)tag_length + 4)) return false;
+    if (check_postfix && peek_uint32(src.fetch(offset + 11 + tag_length, 4)) != (tag_length + 11)) return false;
+    offset += 11 + tag_length + 4;
+  }
+  return true;
+}
+
+uint64_t hint_job::resync(input_source& src, uint64_t from, uint64_t end, bool check_postfix) {
+  vector<uint64_t> candidates;
+  for (uint64_t w = from; w < end; w += RESYNC_WINDOW) {
+    // collect the window's candidates before checking any: that fetches other parts of the file
+    size_t len = std::min<uint64_t>(end - w, RESYNC_WINDOW + 10);
+    const char* window = src.fetch(w, len);
+    const char* wend = window + len;
+    candidates.clear();
+    for (const char* p = next_tag_candidate(window, wend); p != wend; p = next_tag_candidate(p + 1, wend)) {
+      candidates.push_back(w + (p - window));
+    }
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      if (tag_chain(src, candidates[i], end, check_postfix, RESYNC_CHAIN)) return candidates[i];
+    }
+  }
+  return end;
+}
+
+void hint_job::skip_damage(uint64_t from, uint64_t to) {
+  fprintf(log, "WARNING: Skipping %llu bytes of damaged tag data at 0x%llx-0x%llx\n", (unsigned long long)(to - from), (unsigned long long)from, (unsigned long long)to);
+  stats.skipped.push_back(std::make_pair(from, to));
+}
+
+void hint_job::scan(input_source& src, uint64_t tag_stream_start, uint64_t& end) {
+  uint64_t offset = tag_stream_start;
+  uint32_t last_timestamp = 0;
+  // -recover holds each tag to its PreviousTagSize postfix if the file fills them in (going by the
+  // first tag); if it doesn't, a tag only counts if the one after it looks like a tag too
+  bool check_postfix = opts.recover && tag_chain(src, offset, end, true, 1);
+  uint64_t damaged = 0;
+
+  while (offset < end) {
+    if (opts.recover && (end - offset) >= 15 && ! tag_chain(src, offset, end, check_postfix, check_postfix ? 1 : 2)) {
+      uint64_t next = resync(src, offset + 1, end, check_postfix);
+      skip_damage(offset, next);
+      damaged += next - offset;
+      if (next == end) {
+        end = offset; // nothing after it to recover: the stream ends here
+        break;
+      }
+      offset = next;
+      continue;
+    }
+    // the header and the first byte of the body are all we need from most tags
+    char* tag_start = src.fetch(offset, std::min<uint64_t>(end - offset, 15));
+    tag_check c = check_tag(tag_start, end - offset);
+    if (c != TAG_OK) {
+      truncate_stream(c, tag_start, offset, end);
+      break;
+    }
+    char* fptr = tag_start;
+    char tag_type = *(fptr++);
+    uint32_t tag_length = deserialize_uint24(fptr);
+    uint32_t tag_timestamp = process_timestamp(tag_type, fptr, last_timestamp);
+
+    count_tag(totals, tag_type, tag_length, tag_start + 11);
+    uint8_t flags = tag_index::content_flags(tag_type, tag_length, tag_start + 11);
+    if (tag_timestamp != (peek_uint24(tag_start + 4) | ((tag_start[7] & 0xff) << 24))) flags |= TAG_REPAIRED;
+    index.push(offset, tag_type, tag_length, tag_timestamp, flags);
+    if (inspects_body(tag_type, tag_length)) tag_start = src.fetch(offset, 11 + tag_length + 4);
+    inspect_tag(tag_type, tag_length, tag_timestamp, tag_start + 11, offset);
+    offset += 11 + tag_length + 4; // header, body and length postfix
+  }
+  totals.last_timestamp = last_timestamp;
+  if (damaged) fprintf(log, "Recovered the tag stream around %zu damaged ranges (%llu bytes skipped)\n", stats.skipped.size(), (unsigned long long)damaged);
+}
+
+/*
+  Parallel scan.
+
+  The tag stream is cut into equal slices and each thread has to find where the
+  first tag in its slice starts. A candidate offset is only believed if its tag
+  header is sane, its PreviousTagSize postfix matches its length, the postfix just
+  before it points back at another sane tag and the tag after it is sane too.
+  Each thread then walks its slice exactly like the serial scan, stopping at the
+  first tag that starts past the end of the slice, and keeps its own counts, its
+  own tag index (with the raw timestamps) and anything that needs looking at
+  more closely.
+
+  The slices are stitched back together in order: a slice's results are only used
+  if it started exactly where the previous slice's walk ended, otherwise (a false
+  sync, or a file that doesn't fill in PreviousTagSize) it's walked again from the
+  right place on this thread. Timestamp repair and the metadata/codec parsing are
+  then replayed in file order as the slice indexes are joined together, so the
+  result is the same as the serial scan's.
+*/
+
+static bool plausible_tag(const char* p, const char* fend) {
+  if ((p + 15) > fend) return false;
+  if (p[0] != 8 && p[0] != 9 && p[0] != 18) return false;
+  if (p[8] || p[9] || p[10]) return false; // stream ID is always 0
+  uint32_t tag_length = peek_uint24(p + 1);
+  if ((p + 11 + tag_length + 4) > fend) return false;
+  return peek_uint32(p + 11 + tag_length) == (tag_length + 11);
+}
+
+static bool tag_boundary(const char* p, const char* tag_stream_start, const char* fend) {
+  if (! plausible_tag(p, fend)) return false;
+  // the previous tag's size postfix sits right in front of us, and has to lead back to a tag of that size
+  uint32_t prev_size = peek_uint32(p - 4);
+  if (prev_size < 11 || (size_t)(p - 4 - tag_stream_start) < prev_size) return false;
+  const char* prev = p - 4 - prev_size;
+  if (! plausible_tag(prev, fend) || (peek_uint24(prev + 1) + 11) != prev_size) return false;
+  // and so does the next tag (if there is one)
+  const char* next = p + 11 + peek_uint24(p + 1) + 4;
+  return (next >= fend) || plausible_tag(next, fend);
+}
+
+class scan_slice : public work_item {
+public:
+  scan_slice(char* _fbase, char* _tag_stream_start, char* _from, char* _limit, char* _fend) :
+    fbase(_fbase), tag_stream_start(_tag_stream_start), from(_from), limit(_limit), fend(_fend), start(NULL), end(NULL), stop(TAG_OK), first_video(NULL), first_audio(NULL) {}
+
+  virtual void run() {
+    if (from == tag_stream_start) {
+      walk(from);
+      return;
+    }
+    for (char* p = from; p < limit; ++p) {
+      if (tag_boundary(p, tag_stream_start, fend)) {
+        walk(p);
+        return;
+      }
+    }
+  }
+
+  void walk(char* p) {
+    start = p;
+    while (p < limit && p < fend) {
+      stop = check_tag(p, fend);
+      if (stop != TAG_OK) break;
+      char tag_type = p[0];
+      uint32_t tag_length = peek_uint24(p + 1);
+      index.push(p - fbase, tag_type, tag_length, peek_uint24(p + 4) | ((p[7] & 0xff) << 24), tag_index::content_flags(tag_type, tag_length, p + 11));
+      hint_job::count_tag(totals, tag_type, tag_length, p + 11);
+      if (tag_type == 9) {
+        if (! first_video) first_video = p;
+      } else if (tag_type == 8 && tag_length > 0) {
+        if (! first_audio) first_audio = p;
+      } else {
+        events.push_back(std::make_pair((uint32_t)(index.size() - 1), p));
+      }
+      p += 11 + tag_length + 4;
+    }
+    end = p;
+  }
+
+  char* fbase;
+  char* tag_stream_start;
+  char* from;
+  char* limit;
+  char* fend;
+
+  char* start; // first tag walked (NULL if no tag boundary was found in the slice)
+  char* end; // where the walk stopped
+  tag_check stop; // why, if it hit the end of the data
+  scan_totals totals;
+  tag_index index; // tags walked, with timestamps as stored in the file
+  vector<pair<uint32_t, char*> > events; // (index into index, tag) for meta and unknown tags
+  char* first_video;
+  char* first_audio;
+} ;
+
+void hint_job::scan_parallel(char* fbase, uint64_t tag_stream_offset, uint64_t& end) {
+  char* tag_stream_start = fbase + tag_stream_offset;
+  char* fend = fbase + end;
+  size_t nslices = opts.scan_threads * 4; // a few per thread to even out the load
+  size_t slice_len = (fend - tag_stream_start) / nslices;
+  vector<scan_slice*> slices;
+  for (size_t i = 0; i < nslices; ++i) {
+    char* from = tag_stream_start + (i * slice_len);
+    char* limit = (i == nslices - 1) ? fend : (from + slice_len);
+    slices.push_back(new scan_slice(fbase, tag_stream_start, from, limit, fend));
+  }
+  {
+    work_pool pool(opts.scan_threads);
+    for (size_t i = 0; i < nslices; ++i) pool.submit(slices[i]);
+    pool.wait();
+  }
+
+  char* pos = tag_stream_start;
+  uint32_t last_timestamp = 0;
+  size_t resynced = 0;
+  for (size_t i = 0; i < nslices && pos < fend; ++i) {
+    if (pos >= slices[i]->limit) continue; // the previous slice's last tag covered all of this one
+    if (slices[i]->start != pos) {
+      // didn't sync up with the previous slice; walk it again from where that one left off
+      scan_slice* again = new scan_slice(fbase, tag_stream_start, pos, slices[i]->limit, fend);
+      delete slices[i];
+      slices[i] = again;
+      again->walk(pos);
+      ++resynced;
+    }
+    scan_slice& sl = *slices[i];
+
+    totals.total_audio += sl.totals.total_audio;
+    totals.total_video += sl.totals.total_video;
+    totals.hasVideo |= sl.totals.hasVideo;
+    totals.hasAudio |= sl.totals.hasAudio;
+    totals.hasKeyframes |= sl.totals.hasKeyframes;
+    totals.vframe_count += sl.totals.vframe_count;
+    totals.keyframe_count += sl.totals.keyframe_count;
+
+    // replay timestamps, and the tags that need inspecting, in file order
+    size_t ev = 0;
+    for (size_t t = 0; t < sl.index.size(); ++t) {
+      uint32_t stored_timestamp = sl.index.timestamp(t);
+      uint32_t tag_timestamp = fix_timestamp(sl.index.type(t), stored_timestamp, last_timestamp);
+      index.push(sl.index.offset(t), sl.index.type(t), sl.index.length(t), tag_timestamp, (sl.index.tag_flags(t) & ~TAG_REPAIRED) | ((tag_timestamp != stored_timestamp) ? TAG_REPAIRED : 0));
+      if (ev < sl.events.size() && sl.events[ev].first == t) {
+        char* tag_start = sl.events[ev].second;
+        inspect_tag(tag_start[0], peek_uint24(tag_start + 1), tag_timestamp, tag_start + 11, tag_start - fbase);
+        ++ev;
+      }
+    }
+    // codec parameters come from the first video/audio tag they can be read from
+    for (char* p = sl.first_video; p && ! have_video_params && p < sl.end; p += 11 + peek_uint24(p + 1) + 4) {
+      if (p[0] == 9) inspect_tag(p[0], peek_uint24(p + 1), 0, p + 11, p - fbase);
+    }
+    if (sl.first_audio && ! have_audio_params) {
+      inspect_tag(sl.first_audio[0], peek_uint24(sl.first_audio + 1), 0, sl.first_audio + 11, sl.first_audio - fbase);
+    }
+
+    pos = sl.end;
+    if (sl.stop != TAG_OK) {
+      truncate_stream(sl.stop, pos, pos - fbase, end);
+      break;
+    }
+  }
+  totals.last_timestamp = last_timestamp;
+  if (resynced) fprintf(log, "Parallel scan: %zu of %zu slices had to be rescanned\n", resynced, nslices);
+
+  for (size_t i = 0; i < nslices; ++i) delete slices[i];
+}
+
+void hint_job::dump_metadata(const char* heading) {
+  if (opts.json) {
+    onMetaData->dumpJSON(dump);
+  } else {
+    fputs(heading, dump);
+    onMetaData->dump(dump);
+  }
+  fputc('\n', dump);
+  fflush(dump);
+}
+
+void hint_job::run(const char* filename, const char* outFilename) {
+  if (opts.inplace) {
+    if (outFilename && strcmp(outFilename, filename) != 0) {
+      throw std::runtime_error("-inplace updates the input file; don't give an output filename");
+    }
+    if (is_stream(filename)) {
+      throw std::runtime_error("-inplace needs a regular file, not a stream");
+    }
+    if (opts.clipping()) {
+      throw std::runtime_error("-inplace can't be used with -start/-end");
+    }
+    if (opts.recover) {
+      throw std::runtime_error("-inplace can't be used with -recover: the damage has to be cut out of the file");
+    }
+    {
+      phase_timer inplace_phase(&stats, "inplace");
+      if (update_metadata_in_place(filename)) return;
+    }
+    fprintf(log, "Can't update in place; rewriting the whole file\n");
+    outFilename = filename;
+  }
+  hint(filename, outFilename);
+}
+
+bool hint_job::update_metadata_in_place(const char* filename) {
+  shared_ptr<AMFMixedArray> onMetaData;
+  size_t metadata_offset = 0, metadata_room = 0;
+  {
+    mmfile infile(filename);
+    if (infile.flen < 13 || memcmp(infile.fbase, "FLV\x01", 4) != 0) {
+      fprintf(log, "In-place update: not an FLV file\n");
+      return false;
+    }
+    size_t tag_start = ntohl(*reinterpret_cast<uint32_t*>(infile.fbase + 5)) + 4;
+    if ((tag_start + 11) > infile.flen || infile.fbase[tag_start] != 18) {
+      fprintf(log, "In-place update: first tag is not a metadata tag\n");
+      return false;
+    }
+    char* fptr = infile.fbase + tag_start + 1;
+    uint32_t tag_length = deserialize_uint24(fptr);
+    fptr += 7; // skip timestamp & stream ID
+    if ((tag_start + 11 + tag_length) > infile.flen) {
+      fprintf(log, "In-place update: metadata tag extends past the end of the file\n");
+      return false;
+    }
+    try {
+      AMFView tagKey(fptr, fptr + tag_length);
+      AMFView d = tagKey.following();
+      metadata_offset = (d.data() - infile.fbase);
+      metadata_room = tag_length - (d.data() - fptr);
+      if (! tagKey.isString("onMetaData") || d.typeID() != AMF_TYPE_MIXED_ARRAY) {
+        fprintf(log, "In-place update: first tag is not onMetaData\n");
+        return false;
+      }
+      // Everything but the few keys below is written back just as it was read
+      onMetaData = shared_ptr<AMFMixedArray>(new AMFMixedArray());
+      onMetaData->merge(d, false);
+    } catch (const std::exception& e) {
+      fprintf(log, "In-place update: error reading metadata tag: %s\n", e.what());
+      return false;
+    }
+    if (onMetaData->dmap.find("keyframes") == onMetaData->dmap.end()) {
+      fprintf(log, "In-place update: file has not been hinted yet\n");
+      return false;
+    }
+  }
+
+  onMetaData->dmap["metadatacreator"] = shared_ptr<AMFData>(new AMFString("flvtool++ (Facebook, Motion project, dweatherford)"));
+  onMetaData->dmap["metadatadate"] = shared_ptr<AMFData>(new AMFDate());
+  for (list<pair<string, string> >::const_iterator eti = opts.extra_tags.begin(); eti != opts.extra_tags.end(); ++eti) {
+    onMetaData->dmap[eti->first] = shared_ptr<AMFData>(new AMFString(eti->second));
+  }
+
+  size_t metadata_size = onMetaData->serializedSize();
+  if (metadata_size > metadata_room) {
+    fprintf(log, "In-place update: new metadata needs %zu bytes but only %zu are available\n", metadata_size, metadata_room);
+    return false;
+  }
+
+  fout fp(filename, true, opts.output);
+  fp.seek(metadata_offset);
+  onMetaData->write(fp);
+  fp.fill(metadata_room - metadata_size); // whatever is left over stays padding
+  fp.close();
+  stats.count_output(fp, metadata_room);
+  fprintf(log, "Updated metadata in place (%zu bytes of padding left)\n", metadata_room - metadata_size);
+  return true;
+}
+
+uint64_t hint_job::read_flv_header(input_source& src, uint8_t* flags) {
+  if (src.length < 13) {
+    char errbuf[128];
+    snprintf(errbuf, 128, "Input file is not long enough to contain a valid FLV header (need 13 bytes, got %llu)", (unsigned long long)src.length);
+    throw std::runtime_error(errbuf);
+  }
+
+  char* fptr = src.fetch(0, 9);
+  
+  // check magic & version
+  if (! ((*(fptr++) == 'F') &&
+         (*(fptr++) == 'L') &&
+         (*(fptr++) == 'V') &&
+         (*(fptr++) == 0x01)) ) {
+  
+    throw std::runtime_error("bailing on invalid magic or version");
+  }
+
+  // the flags byte says whether there's audio and video, which we'll work out for ourselves
+  if (flags) *flags = *fptr;
+  ++fptr;
+
+  // grab header size
+  uint32_t header_size = peek_uint32(fptr);
+
+  // we don't care about the extra data, just skip it
+  // and skip the uint32_t unknown extra (should be 0)
+  return header_size + 4;
+}
+
+uint64_t hint_job::scan_file(input_source& src, uint64_t& end) {
+  uint64_t tag_stream_start = read_flv_header(src);
+  end = src.length;
+
+  // (-recover walks the file on one thread: the slices' walks stop at the first bad tag)
+  if (opts.scan_threads > 1 && ! opts.recover && src.base() && end > tag_stream_start && (end - tag_stream_start) >= PARALLEL_SCAN_MIN) {
+    scan_parallel(src.base(), tag_stream_start, end);
+  } else {
+    scan(src, tag_stream_start, end);
+  }
+  return tag_stream_start;
+}
+
+bool hint_job::is_stream(const char* filename) {
+  if (strcmp(filename, "-") == 0) return true;
+  struct stat statbuf;
+  return (stat(filename, &statbuf) == 0) && ! S_ISREG(statbuf.st_mode);
+}
+
+static size_t read_fully(int fd, char* buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t r = ::read(fd, buf + got, len - got);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    got += r;
+  }
+  return got;
+}
+
+void hint_job::spool_stream(int fd, const char* spool_name, bool keep_index) {
+  // one tag at a time; this buffer only ever grows to the largest tag in the stream (16MB at most)
+  vector<char> tag(65536);
+  spool_keyframe_times.clear();
+  spool_keyframe_offsets.clear();
+
+  if (read_fully(fd, &tag[0], 9) < 9) {
+    throw std::runtime_error("Input stream is not long enough to contain a valid FLV header");
+  }
+  if (memcmp(&tag[0], "FLV\x01", 4) != 0) {
+    throw std::runtime_error("bailing on invalid magic or version");
+  }
+  // we don't care about the extra header data or the uint32_t after it; read past them
+  uint32_t header_size = peek_uint32(&tag[5]);
+  uint64_t offset = 9;
+  size_t skip = std::max<uint32_t>(header_size, 9) - 9 + 4;
+  while (skip) {
+    size_t n = std::min(skip, tag.size());
+    if (read_fully(fd, &tag[0], n) < n) throw std::runtime_error("Input stream ended inside the FLV header");
+    skip -= n;
+    offset += n;
+  }
+
+  fout spool;
+  if (spool_name) {
+    spool.open(spool_name, false, opts.output);
+    spool.write("FLV\x01\x05\x00\x00\x00\x09\x00\x00\x00\x00", 13);
+  }
+
+  uint32_t last_timestamp = 0;
+  while (true) {
+    size_t got = read_fully(fd, &tag[0], 11);
+    if (got == 0) break;
+    if (got < 11) {
+      fprintf(log, "WARNING: extra junk at end of file (%zu bytes' worth)\n", got);
+      break;
+    }
+    char tag_type = tag[0];
+    uint32_t tag_length = peek_uint24(&tag[1]);
+    if (tag.size() < (11 + tag_length + 4)) tag.resize(11 + tag_length + 4);
+    if (read_fully(fd, &tag[11], tag_length + 4) < (tag_length + 4)) {
+      fprintf(log, "WARNING: Tag of type %u (%u bytes) at 0x%llx extends past the end of the file; will truncate the stream here.\n", tag_type, tag_length, (unsigned long long)offset);
+      break;
+    }
+    char* fptr = &tag[4];
+    uint32_t tag_timestamp = process_timestamp(tag_type, fptr, last_timestamp);
+
+    count_tag(totals, tag_type, tag_length, &tag[11]);
+    stats.count_tag(tag_type);
+    inspect_tag(tag_type, tag_length, tag_timestamp, &tag[11], offset);
+    if (spool && copies_tag(tag_type, tag_length)) {
+      // the spool gets the repaired timestamp, so its tags can be copied as they are
+      tag[4] = (tag_timestamp >> 16) & 0xff;
+      tag[5] = (tag_timestamp >> 8) & 0xff;
+      tag[6] = tag_timestamp & 0xff;
+      tag[7] = (tag_timestamp >> 24) & 0xff;
+      uint8_t flags = tag_index::content_flags(tag_type, tag_length, &tag[11]);
+      if (keep_index) {
+        index.push(spool.tell(), tag_type, tag_length, tag_timestamp, flags);
+      } else if (flags & TAG_KEYFRAME) {
+        spool_keyframe_times.push_back((double)tag_timestamp / 1000.0);
+        spool_keyframe_offsets.push_back(spool.tell());
+      }
+      spool.write(&tag[0], 11 + tag_length + 4);
+    }
+    offset += 11 + tag_length + 4;
+  }
+  totals.last_timestamp = last_timestamp;
+  stats.bytes_read += offset;
+  stats.input_bytes += offset;
+  spool.close();
+}
+
+void hint_job::hint(const char* filename, const char* outFilename) {
+  // an output filename of - writes the hinted FLV to stdout
+  bool to_stdout = (outFilename && strcmp(outFilename, "-") == 0);
+  string outFilename_tmp;
+  if (outFilename && ! to_stdout) outFilename_tmp = string(outFilename) + ".tmp";
+  // (the metadata dump without an output file is always of the whole input)
+  bool clip = opts.clipping() && outFilename;
+  if (clip) {
+    if (opts.segment_duration > 0) throw std::runtime_error("-segment and -start/-end can't be used together");
+    if (opts.clip_end >= 0 && opts.clip_end <= opts.clip_start) throw std::runtime_error("-end has to be after -start");
+  }
+  if (outFilename && opts.segment_duration > 0) {
+    if (to_stdout) throw std::runtime_error("can't write segments to stdout");
+    string name;
+    if (! segment_filename(outFilename, 0, name)) throw std::runtime_error("-segment needs an output filename pattern with one %d in it (like out-%03d.flv), and no other % but %%");
+  }
+  if (opts.recover && is_stream(filename)) throw std::runtime_error("-recover needs an input file it can seek in, not a stream");
+
+  onMetaData = shared_ptr<AMFMixedArray>(new AMFMixedArray());
+  index.clear();
+  shared_ptr<input_source> infile;
+  // a stream copied whole is written from its spool file, which has no index (just its keyframes)
+  bool spooled = false;
+
+  if (is_stream(filename)) {
+    // Can't map a pipe: scan it as it comes in, keeping the tags we'll copy in a spool file next to the output
+    string spool_name;
+    if (to_stdout) {
+      // nothing to put it next to; use a temporary file
+      const char* tmpdir = getenv("TMPDIR");
+      spool_name = string((tmpdir && *tmpdir) ? tmpdir : "/tmp") + "/flvtool++.spool.XXXXXX";
+      int spool_fd = mkstemp(&spool_name[0]);
+      if (spool_fd == -1) throw std::runtime_error(string("unable to create a spool file: ") + string(strerror(errno)));
+      ::close(spool_fd);
+    } else if (outFilename) {
+      spool_name = outFilename_tmp + ".spool";
+    }
+    int fd = (strcmp(filename, "-") == 0) ? 0 : ::open(filename, O_RDONLY);
+    if (fd == -1) throw std::runtime_error(string("unable to open input stream ") + string(filename));
+    try {
+      phase_timer scan_phase(&stats, "scan");
+      // only cutting the stream up needs every tag indexed
+      spooled = outFilename && ! clip && opts.segment_duration <= 0;
+      spool_stream(fd, outFilename ? spool_name.c_str() : NULL, ! spooled);
+    } catch (...) {
+      if (fd) ::close(fd);
+      if (outFilename) unlink(spool_name.c_str());
+      throw;
+    }
+    if (fd) ::close(fd);
+    if (outFilename) {
+      phase_timer open_phase(&stats, "open");
+      // a spool copied whole is read in order a block at a time, not mapped, so that the copy
+      // pass doesn't grow with the length of the stream either
+      input_options spool_input = opts.input;
+      if (spooled && spool_input.backend != INPUT_URING) spool_input.backend = INPUT_PREAD;
+      infile = shared_ptr<input_source>(input_source::open(spool_name.c_str(), spool_input, log));
+      unlink(spool_name.c_str()); // the open descriptor keeps it around as long as we need it
+    }
+  } else {
+    infile = open_input(filename, clip);
+  }
+  vector<tag_span> spans;
+  {
+    phase_timer metadata_phase(&stats, "metadata");
+    if (clip) {
+      spans = clip_spans(infile.get());
+      totals = span_totals(spans);
+    } else {
+      spans.push_back(tag_span(infile.get(), &index, 0, index.size()));
+    }
+    describe_stream(*onMetaData, totals);
+
+    if (! outFilename) {
+      // dump only mode
+      dump_metadata("");
+      if (infile) stats.bytes_read += infile->bytes_read;
+      return;
+    }
+
+    stamp_metadata(*onMetaData);
+  }
+
+  if (opts.segment_duration > 0) {
+    phase_timer segments_phase(&stats, "segments");
+    write_segments(*infile, outFilename);
+    infile->close();
+    stats.bytes_read += infile->bytes_read;
+    return;
+  }
+
+  fout fp;
+  open_output(fp, outFilename);
+  if (spooled) write_spooled_flv(fp, *infile, totals, *onMetaData, &stats);
+  else write_flv(fp, spans, totals, *onMetaData, &stats);
+
+  // close the output (which waits for any copies still reading from the input), then our input
+  // close both first in case the output is going to overwrite the input on rename
+  {
+    phase_timer flush_phase(&stats, "flush");
+    fp.close();
+  }
+  stats.count_output(fp, fp.tell());
+  infile->close();
+  stats.bytes_read += infile->bytes_read;
+  {
+    phase_timer rename_phase(&stats, "rename");
+    finish_output(fp, outFilename);
+  }
+  report_output();
+}
+
+shared_ptr<input_source> hint_job::index_input(const char* filename) {
+  onMetaData = shared_ptr<AMFMixedArray>(new AMFMixedArray());
+  index.clear();
+  return open_input(filename, false);
+}
+
+shared_ptr<input_source> hint_job::open_input(const char* filename, bool clip) {
+  shared_ptr<input_source> infile;
+  {
+    phase_timer open_phase(&stats, "open");
+    infile = shared_ptr<input_source>(input_source::open(filename, opts.input, log));
+  }
+  phase_timer scan_phase(&stats, "scan");
+  if (! (use_index_cache() && load_index_cache(filename, *infile))) {
+    if (clip && ! opts.recover) {
+      // there's no need to read more of the file than the clip
+      scan_clip(*infile);
+    } else {
+      uint64_t end;
+      scan_file(*infile, end);
+      if (use_index_cache()) save_index_cache(filename, *infile);
+    }
+  }
+  stats.input_bytes += infile->length;
+  for (size_t i = 0; i < index.size(); ++i) stats.count_tag(index.type(i));
+  return infile;
+}
+
+void hint_job::report_output() {
+  double length_sec = (double)totals.last_timestamp / 1000.0;
+  double videodatarate = (((double)totals.total_video * 8.0) / 1000.0) / length_sec;
+  double audiodatarate = (((double)totals.total_audio * 8.0) / 1000.0) / length_sec;
+  fprintf(log, "Total: %lu video bytes (%f kbps), %lu audio bytes (%f kbps), %f seconds long\n", totals.total_video, videodatarate, totals.total_audio, audiodatarate, length_sec);
+  if (! opts.nodump) {
+    dump_metadata("Final onMetaData tag contents: ");
+  }
+}
+
+void hint_job::describe_stream(AMFMixedArray& meta, const scan_totals& t) {
+  double length_sec = (double)t.last_timestamp / 1000.0;
+  double videodatarate = (((double)t.total_video * 8.0) / 1000.0) / length_sec;
+  double audiodatarate = (((double)t.total_audio * 8.0) / 1000.0) / length_sec;
+  double framerate = (double)(t.vframe_count)/length_sec;
+  meta.dmap["hasAudio"] = shared_ptr<AMFData>(new AMFBoolean(t.hasAudio));
+  meta.dmap["hasVideo"] = shared_ptr<AMFData>(new AMFBoolean(t.hasVideo));
+  meta.dmap["hasCuePoints"] = shared_ptr<AMFData>(new AMFBoolean(false));
+  meta.dmap["hasMetadata"] = shared_ptr<AMFData>(new AMFBoolean(true));
+  meta.dmap["canSeekToEnd"] = shared_ptr<AMFData>(new AMFBoolean(true));
+  meta.dmap["duration"] = shared_ptr<AMFData>(new AMFDouble(length_sec));
+  meta.dmap["framerate"] = shared_ptr<AMFData>(new AMFDouble(framerate));
+  meta.dmap["videodatarate"] = shared_ptr<AMFData>(new AMFDouble(videodatarate));
+  meta.dmap["audiodatarate"] = shared_ptr<AMFData>(new AMFDouble(audiodatarate));
+  meta.dmap["videosize"] = shared_ptr<AMFData>(new AMFDouble(t.total_video));
+  meta.dmap["audiosize"] = shared_ptr<AMFData>(new AMFDouble(t.total_audio));
+  meta.dmap["hasKeyframes"] = shared_ptr<AMFData>(new AMFBoolean(t.hasKeyframes));
+  meta.dmap["totalframes"] = shared_ptr<AMFData>(new AMFDouble(t.vframe_count));
+  meta.dmap["lasttimestamp"] = shared_ptr<AMFData>(new AMFDouble((double)t.last_timestamp / 1000.0));
+  meta.dmap["datasize"] = shared_ptr<AMFData>(new AMFDouble(0)); // filled in by write_flv()
+}
+
+void hint_job::stamp_metadata(AMFMixedArray& meta) const {
+  meta.dmap["metadatacreator"] = shared_ptr<AMFData>(new AMFString("flvtool++ (Facebook, Motion project, dweatherford)"));
+  meta.dmap["metadatadate"] = shared_ptr<AMFData>(new AMFDate());
+
+  for (list<pair<string, string> >::const_iterator eti = opts.extra_tags.begin(); eti != opts.extra_tags.end(); ++eti) {
+    meta.dmap[eti->first] = shared_ptr<AMFData>(new AMFString(eti->second));
+  }
+}
+
+scan_totals hint_job::span_totals(const vector<tag_span>& spans) const {
+  scan_totals t;
+  for (size_t s = 0; s < spans.size(); ++s) {
+    const tag_span& sp = spans[s];
+    for (size_t i = sp.first; i < sp.last; ++i) {
+      char tag_type = sp.index->type(i);
+      uint32_t tag_length = sp.index->length(i);
+      if (! copies_tag(tag_type, tag_length)) continue;
+      if (tag_type == 9) {
+        t.hasVideo = true;
+        if (sp.index->keyframe(i)) {
+          t.hasKeyframes = true;
+          ++t.keyframe_count;
+        }
+        t.total_video += (tag_length - 1);
+        ++t.vframe_count;
+        t.last_timestamp = std::max(t.last_timestamp, sp.timestamp(i));
+      } else if (tag_type == 8) {
+        t.hasAudio = true;
+        t.total_audio += tag_length;
+      }
+    }
+  }
+  return t;
+}
+
+void hint_job::open_output(fout& fp, const char* outFilename) {
+  if (strcmp(outFilename, "-") == 0) {
+    // fp closes what it's given; give it a copy of stdout, and leave the program's own open
+    int fd = dup(1);
+    if (fd == -1) throw std::runtime_error(string("unable to write to stdout: ") + string(strerror(errno)));
+    fp.open(fd, opts.output);
+  } else {
+    // write to temporary file then rename into place
+    // in case the output and input files are the same file
+    fp.open((string(outFilename) + ".tmp").c_str(), false, opts.output);
+  }
+}
+
+void hint_job::finish_output(fout& fp, const char* outFilename) {
+  fp.close();
+  if (strcmp(outFilename, "-") == 0) return;
+  string outFilename_tmp = string(outFilename) + ".tmp";
+  if (rename(outFilename_tmp.c_str(), outFilename) != 0) {
+    char errbuf[256];
+    snprintf(errbuf, 255, "Error renaming \"%s\" into place: %s", outFilename_tmp.c_str(), strerror(errno));
+    errbuf[255] = '\0';
+    throw std::runtime_error(errbuf);
+  }
+}
+
+uint64_t hint_job::add_keyframe_index(AMFMixedArray& meta, size_t keyframe_count, shared_ptr<AMFDoubleArray>& keyTimes, shared_ptr<AMFDoubleArray>& keyPositions) const {
+  // Allocate some storage for the keyframe indices we'll build, at their final size
+  // so we can calculate the metadata length (and thus the file positions of the key tags)
+  keyTimes = shared_ptr<AMFDoubleArray>(new AMFDoubleArray(keyframe_count));
+  keyPositions = shared_ptr<AMFDoubleArray>(new AMFDoubleArray(keyframe_count));
+
+  shared_ptr<AMFObject> keyframes(new AMFObject());
+  keyframes->dmap["times"] = keyTimes;
+  keyframes->dmap["filepositions"] = keyPositions;
+  meta.dmap["keyframes"] = keyframes;
+
+  // If we're stripping the metadata then clear the onMetaData block
+  // It throws away some work earlier, but oh well, it was easy
+  if (opts.strip) meta.dmap.clear();
+
+  AMFString mthead("onMetaData");
+  size_t metadata_len = mthead.serializedSize() + meta.serializedSize() + opts.padding; // padding is room for later in-place updates
+  return 13 + 11 + metadata_len + 4; // FLV header, onMetaData tag and its length postfix
+}
+
+void hint_job::write_head(fout& fp, const scan_totals& t, AMFMixedArray& meta, uint64_t datasize) const {
+  // update file length
+  if (! opts.strip) meta.dmap["datasize"] = shared_ptr<AMFData>(new AMFDouble(datasize));
+
+  // Build the FLV header and the onMetaData tag in one go
+  AMFString mthead("onMetaData");
+  size_t metadata_len = mthead.serializedSize() + meta.serializedSize() + opts.padding;
+  vector<char> head(13 + 11 + metadata_len + 4);
+  char* hp = &head[0];
+  memcpy(hp, "FLV\x01", 4);
+  hp += 4;
+  // build flags
+  uint8_t flags = 0;
+  if (t.hasVideo) flags |= 0x04;
+  if (t.hasAudio) flags |= 0x01;
+  *(hp++) = flags;
+  memcpy(hp, "\x00\x00\x00\x09\x00\x00\x00\x00", 8);
+  hp += 8;
+  *(hp++) = 18; // meta tag start
+  hp = poke_uint24(hp, metadata_len);
+  memset(hp, 0, 7); // Timestamp + TimestampExtended = 0, uint24 stream ID = 0
+  hp += 7;
+  hp = mthead.encode(hp);
+  hp = meta.encode(hp);
+  memset(hp, 0, opts.padding);
+  hp += opts.padding;
+  poke_uint32(hp, metadata_len + 11); // tag_size uint32 (incl. header size)
+  fp.write(&head[0], head.size());
+}
+
+uint64_t hint_job::write_flv(fout& fp, const vector<tag_span>& spans, const scan_totals& t, AMFMixedArray& meta, job_stats* timing) {
+  phase_timer metadata_phase(timing, "metadata");
+  size_t keyframe_count = 0;
+  for (size_t s = 0; s < spans.size(); ++s) {
+    for (size_t i = spans[s].first; i < spans[s].last; ++i) {
+      if (spans[s].index->keyframe(i) && copies_tag(spans[s].index->type(i), spans[s].index->length(i))) ++keyframe_count;
+    }
+  }
+  shared_ptr<AMFDoubleArray> keyTimes, keyPositions;
+
+  // Work out where every tag will land in the output before writing any of it, so the
+  // onMetaData tag can be written once, complete, ahead of the tags it describes: nothing
+  // has to be patched up afterwards, and the output doesn't need to be seekable.
+  uint64_t out_pos = add_keyframe_index(meta, keyframe_count, keyTimes, keyPositions);
+  size_t current_keyframe = 0;
+  for (size_t s = 0; s < spans.size(); ++s) {
+    const tag_span& sp = spans[s];
+    for (size_t i = sp.first; i < sp.last; ++i) {
+      if (! copies_tag(sp.index->type(i), sp.index->length(i))) continue;
+      if (sp.index->keyframe(i)) {
+        keyTimes->d[current_keyframe] = (double)sp.timestamp(i) / 1000.0;
+        keyPositions->d[current_keyframe] = out_pos;
+        ++current_keyframe;
+      }
+      out_pos += sp.index->tag_size(i);
+    }
+  }
+
+  uint64_t start_pos = fp.tell();
+  write_head(fp, t, meta, out_pos);
+  metadata_phase.stop();
+  phase_timer copy_phase(timing, "copy");
+
+  // Copy tags from input to output file
+  // Tags that come out byte-for-byte identical to the input are accumulated into a run
+  // and handed to the kernel in one go; only rewritten tag headers go through our buffer.
+  // Everything we need to know about each tag comes from the index the scan pass built;
+  // the input is only read for the bytes we copy (and the rare header we have to rewrite).
+  for (size_t s = 0; s < spans.size(); ++s) {
+    const tag_span& sp = spans[s];
+    input_source& src = *sp.src;
+    uint64_t run_start = 0;
+    size_t run_length = 0;
+    for (size_t i = sp.first; i < sp.last; ++i) {
+      uint64_t offset = sp.index->offset(i);
+      char tag_type = sp.index->type(i);
+      uint32_t tag_length = sp.index->length(i);
+      uint32_t tag_timestamp = sp.timestamp(i);
+
+      if (copies_tag(tag_type, tag_length)) {
+        // a run only covers tags that sit next to each other in the input
+        if (run_length && (run_start + run_length) != offset) {
+          copy_tag_run(fp, src, run_start, run_length);
+          run_length = 0;
+        }
+        if (! sp.index->repaired(i) && ! sp.shift) {
+          // Unmodified tag; append the whole thing (header, body, length postfix) to the run
+          if (! run_length) run_start = offset;
+          run_length += sp.index->tag_size(i);
+        } else {
+          // Timestamp was repaired or moved: emit the new header, then start a run with the tag body
+          if (run_length) copy_tag_run(fp, src, run_start, run_length);
+          char tag_header[11];
+          memcpy(tag_header, src.fetch(offset, 11), 11); // type, length and stream ID stay as they were
+          tag_header[4] = (tag_timestamp >> 16) & 0xff; // timestamp
+          tag_header[5] = (tag_timestamp >> 8) & 0xff;
+          tag_header[6] = tag_timestamp & 0xff;
+          tag_header[7] = (tag_timestamp >> 24) & 0xff; //timestampextended
+          fp.write(tag_header, 11);
+          run_start = offset + 11;
+          run_length = tag_length + 4;
+        }
+      } else {
+        // Skipped tag breaks the run
+        if (run_length) copy_tag_run(fp, src, run_start, run_length);
+        run_length = 0;
+        if (tag_length > 0) {
+          fprintf(log, "WARNING: Skipping unknown tag type %u (%u bytes, timestamp %u ms) at file offset 0x%zx\n", tag_type & 0xff, tag_length, sp.index->timestamp(i), (size_t)offset);
+        } else {
+          fprintf(log, "INFO: Skipping zero size audio tag at file offset 0x%zx\n", (size_t)offset);
+        }
+      }
+    }
+    if (run_length) copy_tag_run(fp, src, run_start, run_length);
+  }
+  if ((fp.tell() - start_pos) != out_pos) {
+    throw std::runtime_error("internal error: the output came out a different size than the tag index said it would");
+  }
+  return out_pos;
+}
+
+uint64_t hint_job::write_spooled_flv(fout& fp, input_source& spool, const scan_totals& t, AMFMixedArray& meta, job_stats* timing) {
+  phase_timer metadata_phase(timing, "metadata");
+  // The spool is the tag stream to write, as it's to be written, after a 13 byte FLV header,
+  // so a tag lands in the output where it is in the spool, plus the difference in headers
+  shared_ptr<AMFDoubleArray> keyTimes, keyPositions;
+  uint64_t tags_start = add_keyframe_index(meta, spool_keyframe_offsets.size(), keyTimes, keyPositions);
+  for (size_t k = 0; k < spool_keyframe_offsets.size(); ++k) {
+    keyTimes->d[k] = spool_keyframe_times[k];
+    keyPositions->d[k] = tags_start + (spool_keyframe_offsets[k] - 13);
+  }
+  uint64_t out_pos = tags_start + (spool.length - 13);
+
+  uint64_t start_pos = fp.tell();
+  write_head(fp, t, meta, out_pos);
+  metadata_phase.stop();
+  phase_timer copy_phase(timing, "copy");
+
+  // Walk the spool's own tag headers, copying what's been walked a run at a time
+  uint64_t offset = 13, run_start = 13;
+  while (offset < spool.length) {
+    if (check_tag(spool.fetch(offset, std::min<uint64_t>(spool.length - offset, 15)), spool.length - offset) != TAG_OK) {
+      throw std::runtime_error("internal error: the spool file doesn't hold whole tags");
+    }
+    offset += 11 + peek_uint24(spool.fetch(offset, 4) + 1) + 4;
+    if ((offset - run_start) >= SPOOL_COPY_RUN) {
+      copy_tag_run(fp, spool, run_start, offset - run_start);
+      run_start = offset;
+    }
+  }
+  if (offset > run_start) copy_tag_run(fp, spool, run_start, offset - run_start);
+  if ((fp.tell() - start_pos) != out_pos) {
+    throw std::runtime_error("internal error: the output came out a different size than the spool file said it would");
+  }
+  return out_pos;
+}
+
+/*
+  Segmenting (-segment): the tag stream is cut at the keyframes that come closest
+  to making each piece segment_duration long, and each piece is written as a
+  hinted FLV of its own. Every segment after the first starts with the codec
+  sequence headers that were in effect where it was cut (at timestamp 0), and its
+  timestamps, onMetaData and keyframe index count from its own start. The segments
+  are written by a pool of threads straight from the input.
+*/
+
+// Writes one segment; on its own thread, so failures are kept for write_segments() to report
+class segment_writer : public work_item {
+public:
+  segment_writer(hint_job& _job, const string& _filename) : job(_job), filename(_filename), datasize(0), duration(0), ok(false) {}
+
+  virtual void run() {
+    try {
+      AMFMixedArray meta;
+      meta.dmap = job.onMetaData->dmap; // a copy to fill in for this segment; the values themselves are shared, and only read
+      scan_totals t = job.span_totals(spans);
+      hint_job::describe_stream(meta, t);
+      duration = (double)t.last_timestamp / 1000.0;
+      fout fp;
+      job.open_output(fp, filename.c_str());
+      datasize = job.write_flv(fp, spans, t, meta);
+      job.finish_output(fp, filename.c_str());
+      output = fp.counters();
+      ok = true;
+    } catch (const std::exception& e) {
+      error = e.what();
+      unlink((filename + ".tmp").c_str());
+    }
+  }
+
+  hint_job& job;
+  string filename;
+  vector<tag_span> spans;
+  uint64_t datasize;
+  fout_counters output;
+  double duration;
+  bool ok;
+  string error;
+} ;
+
+void hint_job::write_segments(input_source& src, const char* pattern) {
+  uint32_t target = (uint32_t)(opts.segment_duration * 1000.0);
+
+  // Where to cut: each cut is at the keyframe closest to target after the last one, unless
+  // the end of the stream is closer than that
+  vector<size_t> keys;
+  for (size_t i = 0; i < index.size(); ++i) {
+    if (index.keyframe(i) && ! index.config(i)) keys.push_back(i);
+  }
+  vector<size_t> cuts(1, 0);
+  size_t last_key = 0; // position in keys of the last cut
+  while (last_key < keys.size()) {
+    int64_t want = (int64_t)index.timestamp(keys[last_key]) + target;
+    size_t after = last_key + 1;
+    while (after < keys.size() && (int64_t)index.timestamp(keys[after]) < want) ++after;
+    size_t best = keys.size();
+    int64_t best_distance = INT64_MAX;
+    if (after - 1 > last_key) {
+      best = after - 1;
+      best_distance = want - index.timestamp(keys[best]);
+    }
+    if (after < keys.size() && ((int64_t)index.timestamp(keys[after]) - want) < best_distance) {
+      best = after;
+      best_distance = index.timestamp(keys[best]) - want;
+    }
+    if (best == keys.size() || llabs((int64_t)totals.last_timestamp - want) <= best_distance) break;
+    cuts.push_back(keys[best]);
+    last_key = best;
+  }
+  if (keys.empty()) fprintf(log, "WARNING: No keyframes to cut at; writing a single segment\n");
+
+  vector<segment_writer*> writers;
+  size_t video_config = index.size(), audio_config = index.size(); // the sequence headers in effect
+  size_t next = 0;
+  for (size_t c = 0; c < cuts.size(); ++c) {
+    size_t first = cuts[c], last = (c + 1 < cuts.size()) ? cuts[c + 1] : index.size();
+    for (; next < first; ++next) {
+      if (! index.config(next)) continue;
+      if (index.type(next) == 9) video_config = next;
+      else audio_config = next;
+    }
+
+    string name;
+    if (! segment_filename(pattern, c, name)) {
+      for (size_t i = 0; i < writers.size(); ++i) delete writers[i];
+      throw std::runtime_error("bad -segment output filename pattern");
+    }
+    segment_writer* w = new segment_writer(*this, name.c_str());
+    if (c) {
+      if (video_config != index.size()) w->spans.push_back(tag_span(&src, &index, video_config, video_config + 1, -(int64_t)index.timestamp(video_config)));
+      if (audio_config != index.size()) w->spans.push_back(tag_span(&src, &index, audio_config, audio_config + 1, -(int64_t)index.timestamp(audio_config)));
+      w->spans.push_back(tag_span(&src, &index, first, last, -(int64_t)index.timestamp(first)));
+    } else {
+      w->spans.push_back(tag_span(&src, &index, first, last));
+    }
+    writers.push_back(w);
+  }
+
+  {
+    // input that isn't mapped has one set of read buffers, so only one writer can use it at a time
+    work_pool pool(src.base() ? opts.scan_threads : 1);
+    for (size_t i = 0; i < writers.size(); ++i) pool.submit(writers[i]);
+    pool.wait();
+  }
+
+  string error;
+  for (size_t i = 0; i < writers.size(); ++i) {
+    if (writers[i]->ok) {
+      fprintf(log, "Segment %zu: %s, %f seconds, %llu bytes\n", i, writers[i]->filename.c_str(), writers[i]->duration, (unsigned long long)writers[i]->datasize);
+      stats.bytes_written += writers[i]->datasize;
+      stats.flushes += writers[i]->output.flushes;
+      stats.seeks += writers[i]->output.seeks;
+      stats.copies += writers[i]->output.copies;
+    } else {
+      fprintf(log, "Segment %zu: %s FAILED (%s)\n", i, writers[i]->filename.c_str(), writers[i]->error.c_str());
+      if (error.empty()) error = writers[i]->filename + ": " + writers[i]->error;
+    }
+    delete writers[i];
+  }
+  if (! error.empty()) throw std::runtime_error(error);
+}
+
+/*
+  Clipping (-start/-end): the clip starts at the last keyframe at or before the start
+  time and runs up to the end time, with its timestamps counted from that keyframe and
+  the sequence headers in effect there put in front of it (at timestamp 0).
+
+  An input file that hasn't been scanned already (there's no index cache for it) isn't
+  scanned in full: the keyframe index in its onMetaData is enough to find the start
+  of the clip, and the file is only read from there to the end of the clip. (The
+  sequence headers then come from the head of the file, so a stream whose codec
+  configuration changes part way through has to be clipped without one; without a
+  keyframe index, only the tag headers before the clip are read.)
+*/
+
+// Picks the tag a clip starts at, fed tags in stream order until it says it has seen
+// enough: the last video keyframe at or before start (or the first one, if none is that
+// early). In a stream without video any audio tag will do.
+class clip_start_finder {
+public:
+  clip_start_finder(uint32_t _start, bool _has_video) : found(false), at(0), timestamp(0), start(_start), has_video(_has_video) {}
+
+  bool feed(uint64_t tag_at, char tag_type, uint32_t tag_length, uint8_t flags, uint32_t tag_timestamp) {
+    if (flags & TAG_CONFIG) return false;
+    if (! (tag_type == 9 || (tag_type == 8 && tag_length > 0))) return false;
+    if (found && tag_timestamp > start) return true;
+    if (has_video ? (flags & TAG_KEYFRAME) : (tag_type == 8)) {
+      found = true;
+      at = tag_at;
+      timestamp = tag_timestamp;
+    }
+    return false;
+  }
+
+  bool found;
+  uint64_t at; // where the tag is (whatever the caller fed in as tag_at)
+  uint32_t timestamp;
+
+protected:
+  uint32_t start;
+  bool has_video;
+} ;
+
+static uint32_t clip_ms(double seconds) {
+  if (seconds < 0) return UINT32_MAX;
+  return (uint32_t)std::min(seconds * 1000.0, (double)UINT32_MAX);
+}
+
+// Whether a tag is the sort of audio or video tag that marks how far into the stream we are
+static bool clock_tag(char tag_type, uint32_t tag_length, uint8_t flags) {
+  return (tag_type == 9 || (tag_type == 8 && tag_length > 0)) && ! (flags & TAG_CONFIG);
+}
+
+void hint_job::scan_clip(input_source& src) {
+  uint8_t header_flags = 0;
+  uint64_t offset = read_flv_header(src, &header_flags);
+  uint64_t end = src.length;
+  uint32_t start_ms = clip_ms(opts.clip_start), end_ms = clip_ms(opts.clip_end);
+  bool has_video = (header_flags & 0x04);
+  uint32_t last_timestamp = 0;
+
+  // The head of the tag stream: the existing onMetaData (which may have a keyframe index
+  // to find the start of the clip with) and the sequence headers
+  bool indexed = false;
+  uint64_t start_offset = 0;
+  uint32_t start_time = 0;
+  while (offset < end) {
+    char* tag_start = src.fetch(offset, std::min<uint64_t>(end - offset, 15));
+    if (check_tag(tag_start, end - offset) != TAG_OK) break;
+    char tag_type = tag_start[0];
+    uint32_t tag_length = peek_uint24(tag_start + 1);
+    uint8_t flags = tag_index::content_flags(tag_type, tag_length, tag_start + 11);
+    if (tag_type != 18 && ! (flags & TAG_CONFIG)) break;
+    char* fptr = tag_start + 4;
+    uint32_t tag_timestamp = process_timestamp(tag_type, fptr, last_timestamp);
+    if (tag_type == 9) has_video = true;
+    if (flags & TAG_CONFIG) index.push(offset, tag_type, tag_length, tag_timestamp, flags);
+    tag_start = src.fetch(offset, 11 + tag_length + 4);
+    inspect_tag(tag_type, tag_length, tag_timestamp, tag_start + 11, offset);
+    if (tag_type == 18 && ! indexed) indexed = find_clip_start_indexed(src, tag_start + 11, tag_length, start_offset, start_time);
+    offset += 11 + tag_length + 4;
+  }
+
+  if (! indexed) {
+    // No keyframe index to go by: walk the tag headers up to the start of the clip,
+    // keeping track of any sequence headers on the way
+    fprintf(log, "No usable keyframe index in the input; reading the tag headers up to the start of the clip\n");
+    clip_start_finder finder(start_ms, has_video);
+    vector<pair<uint64_t, uint32_t> > configs;
+    while (offset < end) {
+      char* tag_start = src.fetch(offset, std::min<uint64_t>(end - offset, 15));
+      if (check_tag(tag_start, end - offset) != TAG_OK) break;
+      char tag_type = tag_start[0];
+      uint32_t tag_length = peek_uint24(tag_start + 1);
+      uint8_t flags = tag_index::content_flags(tag_type, tag_length, tag_start + 11);
+      char* fptr = tag_start + 4;
+      uint32_t tag_timestamp = process_timestamp(tag_type, fptr, last_timestamp);
+      if (finder.feed(offset, tag_type, tag_length, flags, tag_timestamp)) break;
+      if (flags & TAG_CONFIG) configs.push_back(std::make_pair(offset, tag_timestamp));
+      offset += 11 + tag_length + 4;
+    }
+    if (! finder.found) throw std::runtime_error("no keyframe to start the clip at");
+    start_offset = finder.at;
+    start_time = finder.timestamp;
+    for (size_t i = 0; i < configs.size() && configs[i].first < start_offset; ++i) {
+      char* tag_start = src.fetch(configs[i].first, 15);
+      uint32_t tag_length = peek_uint24(tag_start + 1);
+      index.push(configs[i].first, tag_start[0], tag_length, configs[i].second, tag_index::content_flags(tag_start[0], tag_length, tag_start + 11));
+    }
+  }
+
+  // The clip itself. Its timestamps go in the index counted from start_time, whatever the
+  // tags say, so a file whose timestamps needed repairing before the clip comes out right too.
+  offset = start_offset;
+  const char* start_tag = src.fetch(offset, 15);
+  uint32_t base = peek_uint24(start_tag + 4) | ((start_tag[7] & 0xff) << 24);
+  last_timestamp = base;
+  while (offset < end) {
+    char* tag_start = src.fetch(offset, std::min<uint64_t>(end - offset, 15));
+    tag_check c = check_tag(tag_start, end - offset);
+    if (c != TAG_OK) {
+      truncate_stream(c, tag_start, offset, end);
+      break;
+    }
+    char* fptr = tag_start;
+    char tag_type = *(fptr++);
+    uint32_t tag_length = deserialize_uint24(fptr);
+    uint32_t file_timestamp = peek_uint24(fptr) | ((fptr[3] & 0xff) << 24);
+    int64_t t = (int64_t)start_time + ((int64_t)process_timestamp(tag_type, fptr, last_timestamp) - base);
+    uint32_t tag_timestamp = (uint32_t)std::max<int64_t>(0, std::min<int64_t>(t, UINT32_MAX));
+    uint8_t flags = tag_index::content_flags(tag_type, tag_length, tag_start + 11);
+    if (offset != start_offset && clock_tag(tag_type, tag_length, flags) && tag_timestamp > end_ms) break;
+
+    if (tag_timestamp != file_timestamp) flags |= TAG_REPAIRED;
+    index.push(offset, tag_type, tag_length, tag_timestamp, flags);
+    if (inspects_body(tag_type, tag_length)) tag_start = src.fetch(offset, 11 + tag_length + 4);
+    inspect_tag(tag_type, tag_length, tag_timestamp, tag_start + 11, offset);
+    offset += 11 + tag_length + 4;
+  }
+  fprintf(log, "Clip: read %zu tags (%llu bytes) of the input from offset 0x%llx\n", index.size(), (unsigned long long)(offset - start_offset), (unsigned long long)start_offset);
+}
+
+bool hint_job::find_keyframe_index(const char* meta, uint32_t meta_length, AMFView& times, AMFView& positions) {
+  AMFView tagKey(meta, meta + meta_length);
+  AMFView d = tagKey.following();
+  if (! tagKey.isString("onMetaData") || (d.typeID() != AMF_TYPE_MIXED_ARRAY && d.typeID() != AMF_TYPE_OBJECT)) return false;
+  AMFView keyframes = d.find("keyframes");
+  if (! keyframes.valid() || keyframes.typeID() != AMF_TYPE_OBJECT) return false;
+  times = keyframes.find("times");
+  positions = keyframes.find("filepositions");
+  if (! times.valid() || ! positions.valid() || times.typeID() != AMF_TYPE_ARRAY || positions.typeID() != AMF_TYPE_ARRAY) return false;
+  size_t n = times.arraySize();
+  return n && positions.arraySize() == n && times.isDoubleArray() && positions.isDoubleArray();
+}
+
+bool hint_job::keyframe_at(input_source& src, double position) {
+  if (! (position >= 13 && (position + 15) <= src.length)) return false;
+  uint64_t offset = (uint64_t)position;
+  const char* tag_start = src.fetch(offset, 15);
+  if (check_tag(tag_start, src.length - offset) != TAG_OK) return false;
+  uint8_t flags = tag_index::content_flags(tag_start[0], peek_uint24(tag_start + 1), tag_start + 11);
+  return tag_start[0] == 9 && (flags & TAG_KEYFRAME) && ! (flags & TAG_CONFIG);
+}
+
+bool hint_job::find_clip_start_indexed(input_source& src, const char* meta, uint32_t meta_length, uint64_t& start_offset, uint32_t& start_time) {
+  size_t k;
+  double key_time, key_position;
+  try {
+    AMFView times, positions;
+    if (! find_keyframe_index(meta, meta_length, times, positions)) return false;
+    size_t n = times.arraySize();
+
+    // binary search for the first keyframe after the start; the clip starts at the one before it
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+      size_t mid = lo + ((hi - lo) / 2);
+      if (times.doubleAt(mid) <= opts.clip_start) lo = mid + 1;
+      else hi = mid;
+    }
+    k = lo ? (lo - 1) : 0;
+    key_time = times.doubleAt(k);
+    key_position = positions.doubleAt(k);
+  } catch (const std::exception& e) {
+    fprintf(log, "Error reading the keyframe index: %s\n", e.what());
+    return false;
+  }
+
+  // The index may not be for this file as it is now (if it was edited after it was hinted,
+  // say), so it's only believed if there's a keyframe where it says there is
+  if (! (key_time >= 0) || ! keyframe_at(src, key_position)) {
+    fprintf(log, "The keyframe index doesn't match the file; ignoring it\n");
+    return false;
+  }
+  start_offset = (uint64_t)key_position;
+  start_time = clip_ms(key_time);
+  fprintf(log, "Clip starts at keyframe %zu (%f seconds), from the keyframe index\n", k, key_time);
+  return true;
+}
+
+vector<tag_span> hint_job::clip_spans(input_source* src) const {
+  uint32_t start_ms = clip_ms(opts.clip_start), end_ms = clip_ms(opts.clip_end);
+  bool has_video = false;
+  for (size_t i = 0; i < index.size() && ! has_video; ++i) has_video = (index.type(i) == 9);
+
+  clip_start_finder finder(start_ms, has_video);
+  for (size_t i = 0; i < index.size(); ++i) {
+    if (finder.feed(i, index.type(i), index.length(i), index.tag_flags(i), index.timestamp(i))) break;
+  }
+  if (! finder.found) throw std::runtime_error("no keyframe to start the clip at");
+  size_t first = finder.at, last = first;
+  if (index.timestamp(first) > end_ms) {
+    char errbuf[128];
+    snprintf(errbuf, 128, "nothing to clip: the clip would start at the keyframe at %f seconds, which is after -end", index.timestamp(first) / 1000.0);
+    throw std::runtime_error(errbuf);
+  }
+  while (last < index.size() && ! (clock_tag(index.type(last), index.length(last), index.tag_flags(last)) && index.timestamp(last) > end_ms)) ++last;
+
+  // the sequence headers in effect where the clip starts
+  size_t video_config = index.size(), audio_config = index.size();
+  for (size_t i = 0; i < first; ++i) {
+    if (! index.config(i)) continue;
+    if (index.type(i) == 9) video_config = i;
+    else audio_config = i;
+  }
+
+  vector<tag_span> spans;
+  if (video_config != index.size()) spans.push_back(tag_span(src, &index, video_config, video_config + 1, -(int64_t)index.timestamp(video_config)));
+  if (audio_config != index.size()) spans.push_back(tag_span(src, &index, audio_config, audio_config + 1, -(int64_t)index.timestamp(audio_config)));
+  spans.push_back(tag_span(src, &index, first, last, -(int64_t)index.timestamp(first)));
+  fprintf(log, "Clip: %f to %f seconds of the input\n", index.timestamp(first) / 1000.0, ((last > first) ? index.timestamp(last - 1) : index.timestamp(first)) / 1000.0);
+  return spans;
+}
+
+/*
+  Concatenation (-concat): each input is indexed once, like any other input, and the
+  output is written straight from all of them. Every input after the first is
+  moved in time to start a frame after the previous one ends (its own wrapped
+  timestamps having been repaired by its scan, as usual), and its onMetaData and
+  sequence headers are left out, since they have to be the same as the first's.
+*/
+
+// What a decoder has to be set up with to play an index's tags of tag_type: the
+// sequence header, if the codec has them, or the codec ID (and for audio, the
+// format) from the first tag. Empty if there are no such tags.
+static string decoder_setup(const tag_index& index, input_source& src, char tag_type) {
+  for (size_t i = 0; i < index.size(); ++i) {
+    if (index.type(i) != tag_type || index.length(i) == 0) continue;
+    if (index.config(i)) return string(src.fetch(index.offset(i) + 11, index.length(i)), index.length(i));
+    char codec = src.fetch(index.offset(i) + 11, 1)[0];
+    if (tag_type == 9) codec &= 0x0f; // not the frame type
+    return string(1, codec);
+  }
+  return string();
+}
+
+void hint_job::concat(const vector<string>& filenames, const char* outFilename) {
+  if (opts.clipping() || opts.segment_duration > 0 || opts.inplace) {
+    throw std::runtime_error("-concat can't be used with -start/-end, -segment or -inplace");
+  }
+
+  vector<shared_ptr<hint_job> > parts;
+  vector<shared_ptr<input_source> > inputs;
+  for (size_t i = 0; i < filenames.size(); ++i) {
+    const char* filename = filenames[i].c_str();
+    if (is_stream(filename)) throw std::runtime_error(string("can't concatenate ") + filename + ": inputs have to be regular files");
+    fprintf(log, "Input %zu: %s\n", i, filename);
+    shared_ptr<hint_job> part(new hint_job(opts, log));
+    inputs.push_back(part->index_input(filename));
+    parts.push_back(part);
+    stats.add(part->stats);
+
+    if (i) {
+      static const char* what[2] = { "video", "audio" };
+      static const char tag_types[2] = { 9, 8 };
+      for (int t = 0; t < 2; ++t) {
+        if (decoder_setup(part->index, *inputs[i], tag_types[t]) != decoder_setup(parts[0]->index, *inputs[0], tag_types[t])) {
+          throw std::runtime_error(string("can't concatenate ") + filename + ": its " + what[t] + " codec configuration doesn't match " + filenames[0] + "'s");
+        }
+      }
+    }
+  }
+
+  vector<tag_span> spans;
+  int64_t next_start = 0;
+  for (size_t i = 0; i < parts.size(); ++i) {
+    const tag_index& idx = parts[i]->index;
+    size_t first = 0;
+    if (i) {
+      while (first < idx.size() && (idx.type(first) == 18 || idx.config(first))) ++first;
+    }
+    int64_t shift = 0;
+    if (i) {
+      size_t j = first;
+      while (j < idx.size() && ! clock_tag(idx.type(j), idx.length(j), idx.tag_flags(j))) ++j;
+      if (j < idx.size()) shift = next_start - idx.timestamp(j);
+    }
+    spans.push_back(tag_span(inputs[i].get(), &idx, first, idx.size(), shift));
+
+    // The next input starts a frame after this one ends: as long after its last tag as
+    // its last video frame (or audio frame, if there's no video) lasted
+    const tag_span& sp = spans.back();
+    int64_t end = next_start, last_frame[2] = { -1, -1 }, frame_duration[2] = { 0, 0 };
+    for (size_t j = sp.first; j < sp.last; ++j) {
+      if (! clock_tag(idx.type(j), idx.length(j), idx.tag_flags(j))) continue;
+      int64_t ts = sp.timestamp(j);
+      int v = (idx.type(j) == 9) ? 0 : 1;
+      if (last_frame[v] >= 0 && ts > last_frame[v]) frame_duration[v] = ts - last_frame[v];
+      last_frame[v] = ts;
+      end = std::max(end, ts);
+    }
+    next_start = end + std::max<int64_t>(1, frame_duration[0] ? frame_duration[0] : frame_duration[1]);
+  }
+  for (size_t i = 1; i < spans.size(); ++i) {
+    fprintf(log, "Input %zu starts at %f seconds\n", i, (spans[i].first < spans[i].last) ? spans[i].timestamp(spans[i].first) / 1000.0 : 0.0);
+  }
+
+  {
+    phase_timer metadata_phase(&stats, "metadata");
+    onMetaData = parts[0]->onMetaData;
+    totals = span_totals(spans);
+    describe_stream(*onMetaData, totals);
+    stamp_metadata(*onMetaData);
+  }
+
+  fout fp;
+  open_output(fp, outFilename);
+  write_flv(fp, spans, totals, *onMetaData, &stats);
+  // close the output before the inputs, in case the output is going to overwrite one of them on rename
+  {
+    phase_timer flush_phase(&stats, "flush");
+    fp.close();
+  }
+  stats.count_output(fp, fp.tell());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    inputs[i]->close();
+    stats.bytes_read += inputs[i]->bytes_read;
+  }
+  {
+    phase_timer rename_phase(&stats, "rename");
+    finish_output(fp, outFilename);
+  }
+  report_output();
+}
@@ -0,0 +1,268 @@
+/*
+ * flvhint.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "AMFData.h"
+#include "mmfile.h"
+#include "input_source.h"
+#include "fout.h"
+#include "tag_index.h"
+#include "job_stats.h"
+
+inline uint32_t deserialize_uint24(char*& ptr) {
+  uint32_t d = ((*(ptr++)) & 0xff) << 16;
+  d += ((*(ptr++)) & 0xff) << 8;
+  d += ((*(ptr++)) & 0xff);
+  return d;
+}
+
+inline uint32_t peek_uint24(const char* ptr) {
+  return ((ptr[0] & 0xff) << 16) | ((ptr[1] & 0xff) << 8) | (ptr[2] & 0xff);
+}
+
+inline uint32_t peek_uint32(const char* ptr) {
+  return ((ptr[0] & 0xff) << 24) | ((ptr[1] & 0xff) << 16) | ((ptr[2] & 0xff) << 8) | (ptr[3] & 0xff);
+}
+
+inline char* poke_uint24(char* ptr, uint32_t d) {
+  ptr[0] = (d >> 16) & 0xff;
+  ptr[1] = (d >> 8) & 0xff;
+  ptr[2] = d & 0xff;
+  return ptr + 3;
+}
+
+inline char* poke_uint32(char* ptr, uint32_t d) {
+  ptr[0] = (d >> 24) & 0xff;
+  ptr[1] = (d >> 16) & 0xff;
+  ptr[2] = (d >> 8) & 0xff;
+  ptr[3] = d & 0xff;
+  return ptr + 4;
+}
+
+struct hint_options {
+  hint_options() : nomerge(false), nodump(false), json(false), stats(false), nometapackets(false), strip(false), inplace(false), recover(false), padding(0), scan_threads(1), index_sidecar(false), segment_duration(0), clip_start(0), clip_end(-1) {}
+
+  bool nomerge;
+  bool nodump;
+  bool json; // dump metadata as JSON
+  bool stats; // report the job's job_stats
+  bool nometapackets;
+  bool strip;
+  bool inplace;
+  bool recover; // skip over damaged tags to the next good ones, instead of stopping at the first
+  uint32_t padding;
+  unsigned scan_threads; // threads to split the scan pass across (for big enough files)
+  input_options input; // how to read the input file
+  fout_options output; // how to buffer the output file
+  string index_cache_dir; // keep index cache files (see index_cache.h) in this directory...
+  bool index_sidecar; // ...or next to each input file
+  double segment_duration; // if set, cut the output into segments about this many seconds long
+  double clip_start, clip_end; // if set, only write the part of the stream between these (in seconds; clip_end < 0 is the end)
+  bool clipping() const { return clip_start > 0 || clip_end >= 0; }
+  list<pair<string, string> > extra_tags;
+};
+
+// What the scan pass adds up over the tag stream
+struct scan_totals {
+  scan_totals() : total_audio(0), total_video(0), last_timestamp(0), hasVideo(false), hasAudio(false), hasKeyframes(false), vframe_count(0), keyframe_count(0) {}
+
+  size_t total_audio, total_video;
+  uint32_t last_timestamp;
+  bool hasVideo, hasAudio, hasKeyframes;
+  uint32_t vframe_count; // total video frames
+  uint32_t keyframe_count; // keyframe count only
+};
+
+// Part of a tag index to write to an output file, with shift added to every timestamp
+struct tag_span {
+  tag_span(input_source* _src, const tag_index* _index, size_t _first, size_t _last, int64_t _shift = 0) : src(_src), index(_index), first(_first), last(_last), shift(_shift) {}
+
+  uint32_t timestamp(size_t i) const {
+    int64_t t = (int64_t)index->timestamp(i) + shift;
+    return (t < 0) ? 0 : (uint32_t)t;
+  }
+
+  input_source* src; // where the tags are
+  const tag_index* index;
+  size_t first, last; // index entries [first, last)
+  int64_t shift;
+} ;
+
+// Why a tag can't be used: the data ends before the tag header does, or the tag (with its
+// length postfix) runs past the end of the data
+enum tag_check { TAG_OK, TAG_JUNK, TAG_OVERRUN };
+
+// remaining: bytes of data from the start of the tag on
+inline tag_check check_tag(const char* tag_start, uint64_t remaining) {
+  if (remaining < 15) return TAG_JUNK; // If we don't have at least 15 bytes worth of data, this isn't a complete tag.
+  if ((11 + peek_uint24(tag_start + 1) + 4) > remaining) return TAG_OVERRUN;
+  return TAG_OK;
+}
+
+inline tag_check check_tag(const char* tag_start, const char* fend) {
+  return check_tag(tag_start, (uint64_t)(fend - tag_start));
+}
+
+// Everything needed to hint one file. Nothing in here is shared between jobs,
+// so any number of them can run at once on different threads.
+class hint_job {
+public:
+  hint_job(const hint_options& _opts, FILE* _log = stdout) : opts(_opts), log(_log), dump(_log), timestamp_warning_given(false), have_audio_params(false), have_video_params(false), avc_nal_length_size(4) {}
+
+  // Hint filename into outFilename (- for stdout), or just dump its metadata if outFilename is NULL.
+  // Diagnostics go to log; errors are thrown as std::runtime_error.
+  void run(const char* filename, const char* outFilename);
+
+  // Join filenames, one after the other, into one hinted outFilename (- for stdout). The inputs
+  // have to be regular files with the same codec configuration.
+  void concat(const vector<string>& filenames, const char* outFilename);
+
+  // Index filename (from its index cache if there is one, or by scanning it) without writing
+  // anything. The tags are in tags() afterwards, and are in the input source returned.
+  shared_ptr<input_source> index_input(const char* filename);
+  const tag_index& tags() const { return index; }
+
+  // Check the FLV header and return the offset of the start of the tag stream (and the header's flags)
+  static uint64_t read_flv_header(input_source& src, uint8_t* flags = NULL);
+  // The times and filepositions arrays of the keyframe index in an onMetaData tag's body,
+  // as written by write_flv(): all doubles, the same length, not empty. False if there
+  // isn't one; throws if the metadata is malformed.
+  static bool find_keyframe_index(const char* meta, uint32_t meta_length, AMFView& times, AMFView& positions);
+  // Whether there's a video keyframe tag at position in src (as a keyframe index has it)
+  static bool keyframe_at(input_source& src, double position);
+
+  // Try to rewrite the onMetaData tag of an already-hinted file without touching the tag stream.
+  // Returns false (having changed nothing) if the file needs a full rewrite instead.
+  bool update_metadata_in_place(const char* filename);
+
+  uint32_t process_timestamp(char tag_type, char*& fptr, uint32_t& last_timestamp);
+  // Repair a timestamp whose TimestampExtended field wasn't set properly
+  uint32_t fix_timestamp(char tag_type, uint32_t tag_timestamp, uint32_t& last_timestamp);
+
+  // Add a tag's sizes and frame counts into t
+  static void count_tag(scan_totals& t, char tag_type, uint32_t tag_length, const char* body);
+
+  const hint_options& opts;
+  FILE* log;
+  FILE* dump; // where metadata dumps go; log unless changed
+  job_stats stats; // where the time went, and what was read and written
+
+protected:
+  void hint(const char* filename, const char* outFilename);
+  // Write onMetaData to dump, as text after heading or (with opts.json) as a line of JSON
+  void dump_metadata(const char* heading);
+
+  // Fill in the onMetaData fields that describe the tag stream, from the scan's totals or span_totals()
+  static void describe_stream(AMFMixedArray& meta, const scan_totals& t);
+  // ...and the ones that say who wrote it (and the -tag ones)
+  void stamp_metadata(AMFMixedArray& meta) const;
+  // Add up the tags write_flv() would copy from spans, as the scan does for a whole file
+  scan_totals span_totals(const vector<tag_span>& spans) const;
+  // Output goes to a temporary file that finish_output() renames into place; - is stdout
+  void open_output(fout& fp, const char* outFilename);
+  void finish_output(fout& fp, const char* outFilename);
+  // Write a hinted FLV to fp: the FLV header, the onMetaData tag (meta, plus the keyframe index
+  // and datasize) and the tags in spans. Returns the number of bytes written. The metadata and
+  // copy phases are timed in timing, if it isn't NULL.
+  uint64_t write_flv(fout& fp, const vector<tag_span>& spans, const scan_totals& t, AMFMixedArray& meta, job_stats* timing = NULL);
+  // The same for a stream copied whole, from the spool file spool_stream() wrote and the
+  // keyframes it kept
+  uint64_t write_spooled_flv(fout& fp, input_source& spool, const scan_totals& t, AMFMixedArray& meta, job_stats* timing = NULL);
+  // Put a keyframe index of keyframe_count entries (for the caller to fill in) into meta, and
+  // return where the first tag lands in the output, after the FLV header and onMetaData
+  uint64_t add_keyframe_index(AMFMixedArray& meta, size_t keyframe_count, shared_ptr<AMFDoubleArray>& keyTimes, shared_ptr<AMFDoubleArray>& keyPositions) const;
+  // Write the FLV header and the onMetaData tag, with datasize filled in
+  void write_head(fout& fp, const scan_totals& t, AMFMixedArray& meta, uint64_t datasize) const;
+  // Log the totals of what was written and dump its metadata
+  void report_output();
+  // -segment: write pieces of the tag stream to files named by printf pattern
+  void write_segments(input_source& src, const char* pattern);
+  friend class segment_writer;
+
+  // Input that can't be mapped (stdin, pipes, devices) has to be read in a single pass
+  static bool is_stream(const char* filename);
+  // The scan pass over a stream: scans each tag as it's read and, if spool_name isn't NULL,
+  // writes the tags we'll copy to that file, with their repaired timestamps, for the copy
+  // pass to work from instead. Only the keyframes are kept (in spool_keyframe_times and
+  // _offsets, for the keyframe index in onMetaData, which has to be written before any
+  // of the tags), so memory grows with the length of the stream by 16 bytes a keyframe
+  // rather than with every tag. With keep_index, for cutting the stream up, the index
+  // holds every spooled tag (by its offset in the spool file) as well.
+  void spool_stream(int fd, const char* spool_name, bool keep_index);
+  // Open a file and index it: from its index cache if there is one, or by scanning it
+  // (only as much of it as the clip needs, if clip)
+  shared_ptr<input_source> open_input(const char* filename, bool clip);
+  // Check the FLV header of a file and scan its tags. Returns the offset of the start of the tag stream.
+  uint64_t scan_file(input_source& src, uint64_t& end);
+
+  // -start/-end on a file that hasn't been scanned: index only the head of the tag stream
+  // (onMetaData and the sequence headers) and the tags in the clip, which is found from the
+  // existing keyframe index if there is one, or by a walk over the tag headers up to it if not
+  void scan_clip(input_source& src);
+  // Where in the file the clip starts (and that tag's time), from the keyframe index in an
+  // existing onMetaData tag's body; false if there isn't one we can trust
+  bool find_clip_start_indexed(input_source& src, const char* meta, uint32_t meta_length, uint64_t& start_offset, uint32_t& start_time);
+  // The pieces of the index to write for the clip: the sequence headers in effect, then its tags
+  vector<tag_span> clip_spans(input_source* src) const;
+
+  // Index cache files (see index_cache.h). Loading one fills in totals, index and onMetaData
+  // just like a scan would, and returns false if there's no usable cache file for src.
+  bool use_index_cache() const { return opts.index_sidecar || ! opts.index_cache_dir.empty(); }
+  string index_cache_path(const char* filename, const struct stat& statbuf) const;
+  // INDEX_CACHE_ flags for the options that change what the scan finds
+  uint32_t cache_flags() const;
+  bool load_index_cache(const char* filename, input_source& src);
+  void save_index_cache(const char* filename, input_source& src);
+
+  // Whether the copy pass copies this tag to the output
+  bool copies_tag(char tag_type, uint32_t tag_length) const {
+    return (tag_type == 8 && tag_length > 0) || tag_type == 9 || (tag_type == 18 && (!opts.nometapackets));
+  }
+
+  // The scan pass: walk the tag stream from offset tag_stream_start, filling in totals and onMetaData.
+  // end is pulled back to the end of the last complete tag if the file is truncated.
+  void scan(input_source& src, uint64_t tag_stream_start, uint64_t& end);
+  // The same over a mapped file, splitting it between opts.scan_threads threads
+  void scan_parallel(char* fbase, uint64_t tag_stream_start, uint64_t& end);
+  void truncate_stream(tag_check why, const char* tag_start, uint64_t tag_offset, uint64_t& end);
+
+  // -recover: whether the count tags from offset on look like a tag stream (sane headers that fit
+  // before end, and lengths that match their PreviousTagSize postfixes if check_postfix)
+  static bool tag_chain(input_source& src, uint64_t offset, uint64_t end, bool check_postfix, unsigned count);
+  // The offset of the first tag at or after from that the tag stream can pick up again at, or end
+  static uint64_t resync(input_source& src, uint64_t from, uint64_t end, bool check_postfix);
+  // Note a damaged range of the input that the scan skipped
+  void skip_damage(uint64_t from, uint64_t to);
+
+  // Pick up the things about a tag that need more than counting: codec parameters,
+  // existing metadata and warnings about tags we don't understand
+  void inspect_tag(char tag_type, uint32_t tag_length, uint32_t tag_timestamp, char* body, size_t tag_offset);
+  // Whether inspect_tag() still needs to look at more than the first byte of this tag's body
+  bool inspects_body(char tag_type, uint32_t tag_length) const {
+    return tag_type == 18 || (tag_type == 9 && ! have_video_params) || (tag_type == 8 && tag_length > 0 && ! have_audio_params);
+  }
+  void inspect_video(char* body, uint32_t tag_length);
+  void inspect_audio(char* body, uint32_t tag_length);
+
+  bool timestamp_warning_given;
+  shared_ptr<AMFMixedArray> onMetaData;
+  scan_totals totals;
+  tag_index index; // every tag the copy pass works from, built by the scan pass
+  vector<double> spool_keyframe_times; // a spooled stream's keyframes: when they are (in seconds)...
+  vector<uint64_t> spool_keyframe_offsets; // ...and where in the spool file
+  mmfile index_cache_map; // index points in here when it came from an index cache file
+  bool have_audio_params, have_video_params;
+  uint8_t avc_nal_length_size; // from the AVC sequence header, for finding NAL units in the tags after it
+
+private:
+  hint_job(const hint_job& _r); // noncopyable
+  hint_job& operator=(const hint_job& _r); // nonassignable
+} ;
+
@@ -6,76 +6,198 @@
  */
 
 #pragma once
-#define BUFFER_SIZE 32768
 #include <string.h> // for strerror
 #include <errno.h>
 #include <stdint.h>
 #include <cstdio>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
+// copy_file_range() lets the kernel move file data between two descriptors without
+// bouncing it through user space (and lets filesystems that support it share extents).
+#if defined(__linux__) && defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+  #define FOUT_HAVE_COPY_FILE_RANGE 1
+#endif
+
+struct fout_options {
+  fout_options() : buffer_size(1024 * 1024), depth(4) {}
+
+  size_t buffer_size; // size of each output buffer
+  unsigned depth; // number of buffers; with more than one, a writer thread writes the full ones while we fill the next
+};
+
+// What an fout has done since it was opened, for -stats
+struct fout_counters {
+  fout_counters() : flushes(0), seeks(0), copies(0) {}
+
+  uint64_t flushes; // buffers handed to the writer
+  uint64_t seeks;
+  uint64_t copies; // copy_range() requests
+};
+
+/*
+  Buffered output file. Full buffers are queued, each with the file offset it
+  belongs at, to a writer thread that pwrite()s them in order while the caller
+  fills the next one; the caller only waits when all depth buffers are full or
+  queued. Because every write carries its own offset, seek() never has to wait
+  for the queue, and tell() is always exact. copy_range() requests go through the
+  same queue, so they land in order with the buffered writes around them.
+  Write errors are remembered by the writer thread and thrown from the next
+  flush(), seek() or close().
+*/
 class fout {
 public:
-  fout() : fp(NULL), buffer_used(0) {}
-  fout(const char* fn) : fp(NULL), buffer_used(0) { this->open(fn); }
-  ~fout() { close(); }
+  fout() : fd(-1), sequential(false) {}
+  fout(const char* fn, bool update = false, const fout_options& opts = fout_options()) : fd(-1), sequential(false) { this->open(fn, update, opts); }
+  ~fout() {
+    try {
+      close();
+    } catch (const std::exception&) {
+      // nowhere to report it from here; callers that care call close() themselves
+    }
+  }
 
-  void open(const char* fn) {
-    if (fp) this->close();
+  // update = true opens an existing file for overwriting in place instead of truncating it
+  void open(const char* fn, bool update = false, const fout_options& opts = fout_options()) {
+    if (fd != -1) this->close();
 
-    fp = fopen(fn, "wb");
-    if (fp == NULL) {
+    fd = ::open(fn, update ? O_RDWR : (O_WRONLY | O_CREAT | O_TRUNC), 0666);
+    if (fd == -1) {
       char errbuf[256];
       snprintf(errbuf, 255, "Error opening output file \"%s\": %s", fn, strerror(errno));
       errbuf[255] = '\0';
       throw std::runtime_error(errbuf);
     }
+    sequential = false;
+    start(opts);
+  }
+
+  // Write to an already open descriptor (a pipe, say), which we take over. Output to it
+  // has to be written in order: seek() can only move to where we already are.
+  void open(int _fd, const fout_options& opts = fout_options()) {
+    if (fd != -1) this->close();
+    fd = _fd;
+    sequential = true;
+    start(opts);
   }
 
   operator bool() const {
-    return (fp != NULL);
+    return (fd != -1);
   }
 
+  // Hand the current buffer to the writer
   void flush() {
-    if (buffer_used) fwrite(buffer, buffer_used, 1, fp);
-    buffer_used = 0;
+    if (buffer_used) {
+      ++counts.flushes;
+      write_item item;
+      item.buf = buffer;
+      item.len = buffer_used;
+      item.offset = pos;
+      pos += buffer_used;
+      buffer_used = 0;
+      buffer = submit(item);
+    }
+    check_error();
   }
 
-  void close() {
-    if (fp) {
-      this->flush();
-      fclose(fp);
-      fp = NULL;
+  // Flush, and wait until everything queued so far is in the file
+  void sync() {
+    this->flush();
+    if (threaded) {
+      pthread_mutex_lock(&lock);
+      while (busy || ! queue.empty()) pthread_cond_wait(&space_available, &lock);
+      pthread_mutex_unlock(&lock);
     }
+    check_error();
+  }
+
+  void close() {
+    if (fd == -1) return;
+    this->flush();
+    int err = shutdown();
+    if (err) throw std::runtime_error(std::string("Error writing output file: ") + std::string(strerror(err)));
   }
 
   void write(const char* dat, size_t len) {
-    if ((len + buffer_used) > BUFFER_SIZE) {
-      this->flush();
-    }
-    if (len > BUFFER_SIZE) fwrite(dat, len, 1, fp);
-    else {
-      memcpy(buffer + buffer_used, dat, len);
-      buffer_used += len;
+    while (len) {
+      if (buffer_used == buffer_size) this->flush();
+      size_t n = std::min<size_t>(len, buffer_size - buffer_used);
+      memcpy(buffer + buffer_used, dat, n);
+      buffer_used += n;
+      dat += n;
+      len -= n;
     }
   }
 
+  // Copy len bytes starting at offset in the (regular file) descriptor fd to the current
+  // output position. Uses copy_file_range() where the kernel can do it for this pair of
+  // files and reads and writes the data itself where it can't. fd has to stay open until
+  // the next sync() or close().
+  void copy_range(int src_fd, uint64_t offset, size_t len) {
+    this->flush();
+    ++counts.copies;
+    write_item item;
+    item.buf = NULL;
+    item.len = len;
+    item.offset = pos;
+    item.src_fd = src_fd;
+    item.src_offset = offset;
+    pos += len;
+    submit(item);
+  }
+
   void write_u24_be(uint32_t d) {
     putc((d >> 16) & 0xff);
     putc((d >> 8) & 0xff);
     putc(d & 0xff);
   }
 
+  // write len zero bytes
+  void fill(size_t len) {
+    while (len) {
+      if (buffer_used == buffer_size) this->flush();
+      size_t n = std::min<size_t>(len, buffer_size - buffer_used);
+      memset(buffer + buffer_used, 0, n);
+      buffer_used += n;
+      len -= n;
+    }
+  }
+
   void putc(char c) {
-    if (buffer_used == BUFFER_SIZE) this->flush();
+    if (buffer_used == buffer_size) this->flush();
     buffer[buffer_used++] = c;
   }
 
+  const fout_counters& counters() const { return counts; }
+
   uint64_t tell() {
-    return (ftello(fp) + ((uint64_t)buffer_used));
+    return (pos + ((uint64_t)buffer_used));
   }
 
   void seek(uint64_t offset, int whence = SEEK_SET) {
     this->flush();
-    fseek(fp, offset, whence);
+    ++counts.seeks;
+    if (sequential) {
+      if ((whence == SEEK_SET && offset == pos) || (whence == SEEK_CUR && offset == 0)) return;
+      throw std::runtime_error("Can't seek in this output");
+    }
+    if (whence == SEEK_CUR) {
+      pos += offset;
+    } else if (whence == SEEK_END) {
+      this->sync();
+      struct stat statbuf;
+      fstat(fd, &statbuf);
+      pos = statbuf.st_size + offset;
+    } else {
+      pos = offset;
+    }
   }
 
   template <typename T> inline void write(T d) {
@@ -89,11 +211,185 @@ public:
   }
 
 protected:
-  FILE* fp;
-  uint32_t buffer_used;
-  char buffer[BUFFER_SIZE];
+  // Set up the buffers (and the writer thread) for a newly opened fd
+  void start(const fout_options& opts) {
+    buffer_size = std::max<size_t>(opts.buffer_size, 4096);
+    pos = 0;
+    buffer_used = 0;
+    counts = fout_counters();
+    error = 0;
+    copy_range_ok = true;
+    stopping = false;
+    busy = false;
+    buffers.resize(std::max(opts.depth, 1u));
+    for (size_t i = 0; i < buffers.size(); ++i) buffers[i] = new char[buffer_size];
+    free_buffers.assign(buffers.begin() + 1, buffers.end());
+    buffer = buffers[0];
+
+    threaded = (buffers.size() > 1);
+    if (threaded) {
+      pthread_mutex_init(&lock, NULL);
+      pthread_cond_init(&work_available, NULL);
+      pthread_cond_init(&space_available, NULL);
+      if (pthread_create(&writer, NULL, &fout::writer_main, this) != 0) {
+        pthread_cond_destroy(&space_available);
+        pthread_cond_destroy(&work_available);
+        pthread_mutex_destroy(&lock);
+        threaded = false; // write synchronously instead
+      }
+    }
+  }
+
+  struct write_item {
+    char* buf; // NULL for a copy_range() request
+    size_t len;
+    uint64_t offset; // where it goes in the output
+    int src_fd; // copy_range() only
+    uint64_t src_offset;
+  };
+
+  // Queue an item (or write it right now without a writer thread). Returns the buffer to fill next.
+  char* submit(const write_item& item) {
+    if (! threaded) {
+      if (! error) error = perform(item);
+      return item.buf ? item.buf : buffer;
+    }
+    pthread_mutex_lock(&lock);
+    queue.push_back(item);
+    pthread_cond_signal(&work_available);
+    char* next = buffer;
+    if (item.buf) {
+      while (free_buffers.empty()) pthread_cond_wait(&space_available, &lock);
+      next = free_buffers.back();
+      free_buffers.pop_back();
+    }
+    pthread_mutex_unlock(&lock);
+    return next;
+  }
+
+  static void* writer_main(void* arg) {
+    static_cast<fout*>(arg)->writer_loop();
+    return NULL;
+  }
+
+  void writer_loop() {
+    pthread_mutex_lock(&lock);
+    while (true) {
+      while (queue.empty() && ! stopping) pthread_cond_wait(&work_available, &lock);
+      if (queue.empty()) break;
+      write_item item = queue.front();
+      queue.pop_front();
+      busy = true;
+      bool failed = (error != 0); // once the file is bad, don't make it worse
+      pthread_mutex_unlock(&lock);
+
+      int err = failed ? 0 : perform(item);
+
+      pthread_mutex_lock(&lock);
+      if (err && ! error) error = err;
+      busy = false;
+      if (item.buf) free_buffers.push_back(item.buf);
+      pthread_cond_broadcast(&space_available);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  // Runs on the writer thread (or inline when there isn't one). Returns an errno on failure.
+  int perform(const write_item& item) {
+    if (item.buf) return write_fully(item.buf, item.len, item.offset);
+    size_t copied = 0;
+#ifdef FOUT_HAVE_COPY_FILE_RANGE
+    loff_t in_off = item.src_offset;
+    loff_t out_off = item.offset;
+    while (copy_range_ok && copied < item.len) {
+      ssize_t r = copy_file_range(item.src_fd, &in_off, fd, sequential ? NULL : &out_off, item.len - copied, 0);
+      if (r <= 0) {
+        // ENOSYS, EXDEV, EINVAL etc. mean this pair of files will never work; don't keep trying
+        if (r < 0 && errno != EINTR && errno != EAGAIN) copy_range_ok = false;
+        if (r == 0) break;
+        continue;
+      }
+      copied += r;
+    }
+#endif
+    // whatever the kernel wouldn't copy, we do by hand
+    if (copied < item.len && scratch.empty()) scratch.resize(buffer_size);
+    while (copied < item.len) {
+      ssize_t r = pread(item.src_fd, &scratch[0], std::min(scratch.size(), item.len - copied), item.src_offset + copied);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) return (r < 0) ? errno : EIO;
+      int err = write_fully(&scratch[0], r, item.offset + copied);
+      if (err) return err;
+      copied += r;
+    }
+    return 0;
+  }
+
+  int write_fully(const char* dat, size_t len, uint64_t offset) {
+    while (len) {
+      ssize_t r = sequential ? ::write(fd, dat, len) : pwrite(fd, dat, len, offset);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) return (r < 0) ? errno : EIO;
+      dat += r;
+      len -= r;
+      offset += r;
+    }
+    return 0;
+  }
+
+  void check_error() {
+    if (threaded) pthread_mutex_lock(&lock);
+    int err = error;
+    if (threaded) pthread_mutex_unlock(&lock);
+    if (err) throw std::runtime_error(std::string("Error writing output file: ") + std::string(strerror(err)));
+  }
+
+  // Stop the writer once it's done with the queue, and close the file. Doesn't throw;
+  // returns the first write error, if any.
+  int shutdown() {
+    if (fd == -1) return 0;
+    if (threaded) {
+      pthread_mutex_lock(&lock);
+      stopping = true;
+      pthread_cond_signal(&work_available);
+      pthread_mutex_unlock(&lock);
+      pthread_join(writer, NULL);
+      pthread_cond_destroy(&space_available);
+      pthread_cond_destroy(&work_available);
+      pthread_mutex_destroy(&lock);
+      threaded = false;
+    }
+    if (::close(fd) != 0 && ! error) error = errno;
+    fd = -1;
+    for (size_t i = 0; i < buffers.size(); ++i) delete[] buffers[i];
+    buffers.clear();
+    free_buffers.clear();
+    queue.clear();
+    return error;
+  }
+
+  int fd;
+  size_t buffer_size;
+  uint64_t pos; // file offset of buffer[0]
+  size_t buffer_used;
+  char* buffer; // the buffer being filled
+  std::vector<char*> buffers; // all of them
+  std::vector<char> scratch; // for copy_range() requests the kernel won't do
+
+  bool sequential; // write() in order instead of pwrite()ing at offsets
+  bool threaded;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t work_available;
+  pthread_cond_t space_available; // a buffer came back, or the writer went idle
+  std::deque<write_item> queue;
+  std::vector<char*> free_buffers;
+  bool stopping;
+  bool busy; // the writer is working on an item it has taken off the queue
+  int error; // first write error (set by the writer thread, read under lock)
+  bool copy_range_ok;
+  fout_counters counts;
 private:
   fout(const fout& _r); // noncopyable
   fout& operator=(const fout& _r); // nonassignable
 } ;
-
@@ -0,0 +1,156 @@
+/*
+ * index_cache.cpp
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#include "flvhint.h"
+#include "index_cache.h"
+
+// Fill in the parts of the header that identify the input file
+static void cache_key(index_cache_header& h, const struct stat& statbuf) {
+  h.dev = statbuf.st_dev;
+  h.ino = statbuf.st_ino;
+  h.size = statbuf.st_size;
+  h.mtime_sec = statbuf.st_mtime;
+#ifdef __APPLE__
+  h.mtime_nsec = statbuf.st_mtimespec.tv_nsec;
+#else
+  h.mtime_nsec = statbuf.st_mtim.tv_nsec;
+#endif
+}
+
+string hint_job::index_cache_path(const char* filename, const struct stat& statbuf) const {
+  if (opts.index_sidecar) return string(filename) + ".flvidx";
+  char name[64];
+  snprintf(name, 64, "/%llx-%llx.flvidx", (unsigned long long)statbuf.st_dev, (unsigned long long)statbuf.st_ino);
+  return opts.index_cache_dir + name;
+}
+
+uint32_t hint_job::cache_flags() const {
+  return (opts.nomerge ? INDEX_CACHE_NOMERGE : 0) | (opts.recover ? INDEX_CACHE_RECOVER : 0);
+}
+
+bool hint_job::load_index_cache(const char* filename, input_source& src) {
+  struct stat statbuf;
+  if (fstat(src.fd, &statbuf) != 0) return false;
+  string path = index_cache_path(filename, statbuf);
+  if (access(path.c_str(), R_OK) != 0) return false;
+
+  index_cache_header key;
+  cache_key(key, statbuf);
+  try {
+    index_cache_map.open(path.c_str());
+  } catch (const std::exception& e) {
+    fprintf(log, "WARNING: Can't read index cache: %s\n", e.what());
+    return false;
+  }
+  const index_cache_header* h = (const index_cache_header*) index_cache_map.fbase;
+  if (index_cache_map.flen < sizeof(index_cache_header) ||
+      memcmp(h->magic, INDEX_CACHE_MAGIC, 8) != 0 ||
+      h->byte_order != INDEX_CACHE_BYTE_ORDER ||
+      h->tag_count > (index_cache_map.flen - sizeof(index_cache_header)) / tag_index::storage_size(1) ||
+      (index_cache_map.flen - sizeof(index_cache_header)) < tag_index::storage_size(h->tag_count) ||
+      (index_cache_map.flen - sizeof(index_cache_header) - tag_index::storage_size(h->tag_count)) != h->metadata_length) {
+    fprintf(log, "WARNING: Ignoring damaged index cache %s\n", path.c_str());
+    index_cache_map.close();
+    return false;
+  }
+  if (h->dev != key.dev || h->ino != key.ino || h->size != key.size || h->mtime_sec != key.mtime_sec || h->mtime_nsec != key.mtime_nsec ||
+      h->flags != cache_flags()) {
+    index_cache_map.close(); // stale; we'll scan and replace it
+    return false;
+  }
+
+  char* data = index_cache_map.fbase + sizeof(index_cache_header);
+  size_t index_size = tag_index::storage_size(h->tag_count);
+  // everything after this reads the input where the index says the tags are, so check that
+  // they're all inside it, one after another, before believing any of it
+  index.attach(data, h->tag_count);
+  uint64_t tag_end = 0;
+  for (size_t i = 0; i < index.size(); ++i) {
+    if (index.offset(i) < tag_end || index.offset(i) > src.length || index.tag_size(i) > (src.length - index.offset(i))) {
+      fprintf(log, "WARNING: Ignoring damaged index cache %s (tag %zu isn't inside the input)\n", path.c_str(), i);
+      index.clear();
+      index_cache_map.close();
+      return false;
+    }
+    tag_end = index.offset(i) + index.tag_size(i);
+  }
+  try {
+    AMFView d(data + index_size, data + index_size + h->metadata_length);
+    if (d.typeID() != AMF_TYPE_MIXED_ARRAY) throw std::runtime_error("metadata isn't an array");
+    onMetaData = shared_ptr<AMFMixedArray>(new AMFMixedArray());
+    onMetaData->merge(d, false); // left encoded until something needs it
+  } catch (const std::exception& e) {
+    fprintf(log, "WARNING: Ignoring damaged index cache %s (%s)\n", path.c_str(), e.what());
+    index.clear();
+    index_cache_map.close();
+    return false;
+  }
+
+  totals.total_audio = h->total_audio;
+  totals.total_video = h->total_video;
+  totals.last_timestamp = h->last_timestamp;
+  totals.vframe_count = h->vframe_count;
+  totals.keyframe_count = h->keyframe_count;
+  totals.hasVideo = h->hasVideo;
+  totals.hasAudio = h->hasAudio;
+  totals.hasKeyframes = h->hasKeyframes;
+  fprintf(log, "Using index cache %s (%zu tags)\n", path.c_str(), index.size());
+  return true;
+}
+
+void hint_job::save_index_cache(const char* filename, input_source& src) {
+  struct stat statbuf;
+  if (fstat(src.fd, &statbuf) != 0) return;
+  string path = index_cache_path(filename, statbuf);
+  // a temporary file of our own: other jobs and processes can be caching the same input
+  // at the same time, and each one's cache goes into place whole
+  string path_tmp = path + ".tmp.XXXXXX";
+  int fd = mkstemp(&path_tmp[0]);
+  if (fd == -1) {
+    fprintf(log, "WARNING: Couldn't write index cache %s: %s\n", path.c_str(), strerror(errno));
+    return;
+  }
+  fchmod(fd, 0644); // (mkstemp() makes it readable only by us)
+
+  index_cache_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, INDEX_CACHE_MAGIC, 8);
+  h.byte_order = INDEX_CACHE_BYTE_ORDER;
+  h.flags = cache_flags();
+  cache_key(h, statbuf);
+  h.total_audio = totals.total_audio;
+  h.total_video = totals.total_video;
+  h.last_timestamp = totals.last_timestamp;
+  h.vframe_count = totals.vframe_count;
+  h.keyframe_count = totals.keyframe_count;
+  h.hasVideo = totals.hasVideo;
+  h.hasAudio = totals.hasAudio;
+  h.hasKeyframes = totals.hasKeyframes;
+  h.tag_count = index.size();
+  h.metadata_length = onMetaData->serializedSize();
+
+  try {
+    fout_options small;
+    small.depth = 1; // not worth a writer thread
+    fout fp;
+    int out = fd;
+    fd = -1; // fp's from here on
+    fp.open(out, small);
+    fp.write((const char*) &h, sizeof(h));
+    index.write(fp);
+    onMetaData->write(fp);
+    fp.close();
+    if (rename(path_tmp.c_str(), path.c_str()) != 0) {
+      throw std::runtime_error(string("rename: ") + string(strerror(errno)));
+    }
+  } catch (const std::exception& e) {
+    fprintf(log, "WARNING: Couldn't write index cache %s: %s\n", path.c_str(), e.what());
+    if (fd != -1) ::close(fd);
+    unlink(path_tmp.c_str());
+  }
+}
@@ -0,0 +1,60 @@
+/*
+ * index_cache.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+  Index cache file: what the scan pass found in an input file, so the next run on
+  the same unchanged file can skip the scan. Laid out as
+
+    index_cache_header
+    the tag index, as written by tag_index::write()
+    the onMetaData array as the scan left it (AMF0), metadata_length bytes
+
+  Everything is in this machine's byte order; the header starts at offset 0 of the
+  file and is a multiple of 8 bytes long, so the index can be used straight out
+  of a mapping of the file. A cache file only counts if the device, inode, size
+  and mtime of the input (and the options that change what the scan produces)
+  all still match.
+*/
+
+#define INDEX_CACHE_MAGIC "FLVIDX\0\2"
+#define INDEX_CACHE_BYTE_ORDER 0x01020304
+
+// index_cache_header flags
+#define INDEX_CACHE_NOMERGE 0x01 // scanned with -nomerge
+#define INDEX_CACHE_RECOVER 0x02 // scanned with -recover
+
+struct index_cache_header {
+  char magic[8];
+  uint32_t byte_order; // INDEX_CACHE_BYTE_ORDER, as written by the machine that made the file
+  uint32_t flags;
+
+  // the input file this describes
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+
+  // scan_totals
+  uint64_t total_audio;
+  uint64_t total_video;
+  uint32_t last_timestamp;
+  uint32_t vframe_count;
+  uint32_t keyframe_count;
+  uint8_t hasVideo;
+  uint8_t hasAudio;
+  uint8_t hasKeyframes;
+  uint8_t reserved;
+
+  uint64_t tag_count;
+  uint64_t metadata_length;
+};
@@ -0,0 +1,298 @@
+/*
+ * input_source.cpp
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#include "input_source.h"
+#include <algorithm>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define INPUT_HAVE_URING 1
+#endif
+
+bool input_options::parse_backend(const char* name) {
+  if (strcmp(name, "mmap") == 0) backend = INPUT_MMAP;
+  else if (strcmp(name, "mmap-seq") == 0) backend = INPUT_MMAP_SEQUENTIAL;
+  else if (strcmp(name, "mmap-populate") == 0) backend = INPUT_MMAP_POPULATE;
+  else if (strcmp(name, "pread") == 0) backend = INPUT_PREAD;
+  else if (strcmp(name, "uring") == 0) backend = INPUT_URING;
+  else return false;
+  return true;
+}
+
+// Parsers peek a few bytes past the end of what they asked for (the AVC
+// sequence header code does), so every buffer we hand out has this much slack.
+#define FETCH_SLACK 16
+
+/*
+  Reads the file in aligned blocks of block_size into a ring of depth buffers.
+  Block n always lives in slot n % depth; whenever a block is fetched, reads
+  for the blocks after it are started in the slots behind it, so by the time
+  the scan gets to them they're (hopefully) already here. A fetch that
+  straddles two blocks is copied together into a separate stitch buffer.
+  Subclasses supply start_read(), which gets a slot's read going, and
+  finish_read(), which waits for it to land.
+*/
+class block_source : public input_source {
+public:
+  block_source(const char* fn, const input_options& opts) : block_size(std::max<size_t>(opts.block_size, 4096)), slots(std::max(opts.depth, 2u)) {
+    fd = ::open(fn, O_RDONLY);
+    if (fd == -1) throw std::runtime_error(string("unable to open file ") + string(fn));
+    struct stat statbuf;
+    fstat(fd, &statbuf);
+    length = statbuf.st_size;
+    for (size_t i = 0; i < slots.size(); ++i) slots[i].buf.resize(block_size + FETCH_SLACK);
+  }
+
+  virtual ~block_source() {
+    // subclasses have to close() in their own destructors, while finish_read() still works
+    if (fd != -1) ::close(fd);
+  }
+
+  virtual char* fetch(uint64_t offset, size_t len) {
+    size_t in_block = offset % block_size;
+    if ((in_block + len) <= block_size) return &(block(offset / block_size).buf[in_block]);
+
+    if (stitch.size() < (len + FETCH_SLACK)) stitch.resize(len + FETCH_SLACK);
+    for (size_t got = 0; got < len; ) {
+      uint64_t o = offset + got;
+      in_block = o % block_size;
+      size_t n = std::min(len - got, block_size - in_block);
+      memcpy(&stitch[got], &(block(o / block_size).buf[in_block]), n);
+      got += n;
+    }
+    return &stitch[0];
+  }
+
+  virtual void close() {
+    if (fd == -1) return;
+    for (size_t i = 0; i < slots.size(); ++i) {
+      if (slots[i].state == slot::PENDING) finish_read(slots[i]);
+    }
+    ::close(fd);
+    fd = -1;
+  }
+
+protected:
+  struct slot {
+    enum slot_state { EMPTY, PENDING, READY };
+    slot() : block(0), valid(0), state(EMPTY) {}
+
+    vector<char> buf;
+    uint64_t block;
+    size_t valid; // bytes of the file in this block (less than block_size only for the last one)
+    slot_state state;
+  };
+
+  virtual void start_read(slot& s) = 0;
+  virtual void finish_read(slot& s) = 0;
+
+  // Read the rest of a slot with plain pread(); returns the bytes read so far
+  size_t read_rest(slot& s, size_t got) {
+    while (got < s.valid) {
+      ssize_t r = ::pread(fd, &s.buf[got], s.valid - got, (s.block * block_size) + got);
+      if (r < 0 && errno == EINTR) continue;
+      if (r < 0) throw std::runtime_error(string("read error: ") + string(strerror(errno)));
+      if (r == 0) throw std::runtime_error("input file got shorter while we were reading it");
+      got += r;
+    }
+    return got;
+  }
+
+  void begin(slot& s, uint64_t b) {
+    if (s.state == slot::PENDING) finish_read(s); // the buffer is still in use by an earlier read
+    s.block = b;
+    s.valid = std::min<uint64_t>(block_size, length - (b * block_size));
+    s.state = slot::PENDING;
+    bytes_read += s.valid;
+    start_read(s);
+  }
+
+  slot& block(uint64_t b) {
+    slot& s = slots[b % slots.size()];
+    if (s.block != b || s.state == slot::EMPTY) begin(s, b);
+    if (s.state == slot::PENDING) finish_read(s);
+    // keep the blocks after this one on their way in
+    for (uint64_t ahead = b + 1; ahead < (b + slots.size()) && (ahead * block_size) < length; ++ahead) {
+      slot& as = slots[ahead % slots.size()];
+      if (as.block != ahead || as.state == slot::EMPTY) begin(as, ahead);
+    }
+    return s;
+  }
+
+  size_t block_size;
+  vector<slot> slots;
+  vector<char> stitch;
+} ;
+
+// Large pread()s, with posix_fadvise() telling the kernel about the blocks we'll want next
+class pread_source : public block_source {
+public:
+  pread_source(const char* fn, const input_options& opts) : block_source(fn, opts) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  }
+  virtual ~pread_source() { this->close(); }
+
+protected:
+  virtual void start_read(slot& s) {
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, s.block * block_size, s.valid, POSIX_FADV_WILLNEED);
+#endif
+  }
+
+  virtual void finish_read(slot& s) {
+    read_rest(s, 0);
+    s.state = slot::READY;
+  }
+} ;
+
+#ifdef INPUT_HAVE_URING
+
+// Thrown when the kernel won't give us a ring (too old, or io_uring is disabled)
+struct uring_unavailable : public std::runtime_error {
+  uring_unavailable(const string& what) : std::runtime_error(what) {}
+};
+
+// Every readahead block is a READV submitted to an io_uring, so depth reads are in flight at once
+class uring_source : public block_source {
+public:
+  uring_source(const char* fn, const input_options& opts) : block_source(fn, opts), ring_fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(MAP_FAILED), iovs(slots.size()) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, (unsigned)slots.size(), &p);
+    if (ring_fd < 0) throw uring_unavailable(strerror(errno));
+
+    sq_ring_len = p.sq_off.array + (p.sq_entries * sizeof(uint32_t));
+    cq_ring_len = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+    sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+      string err = strerror(errno);
+      teardown();
+      throw uring_unavailable(err);
+    }
+
+    char* sq = (char*) sq_ring;
+    sq_tail = (uint32_t*)(sq + p.sq_off.tail);
+    sq_mask = *(uint32_t*)(sq + p.sq_off.ring_mask);
+    sq_array = (uint32_t*)(sq + p.sq_off.array);
+    char* cq = (char*) cq_ring;
+    cq_head = (uint32_t*)(cq + p.cq_off.head);
+    cq_tail = (uint32_t*)(cq + p.cq_off.tail);
+    cq_mask = *(uint32_t*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  }
+
+  virtual ~uring_source() {
+    this->close();
+    teardown();
+  }
+
+protected:
+  virtual void start_read(slot& s) {
+    size_t index = &s - &slots[0];
+    iovs[index].iov_base = &s.buf[0];
+    iovs[index].iov_len = s.valid;
+
+    // we're the only submitter, so the tail is ours to read without ordering
+    uint32_t tail = *sq_tail;
+    uint32_t i = tail & sq_mask;
+    struct io_uring_sqe* sqe = ((struct io_uring_sqe*) sqes) + i;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t) &iovs[index];
+    sqe->len = 1;
+    sqe->off = s.block * block_size;
+    sqe->user_data = index;
+    sq_array[i] = i;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, NULL, 0) < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+      throw std::runtime_error(string("io_uring_enter: ") + string(strerror(errno)));
+    }
+  }
+
+  virtual void finish_read(slot& s) {
+    while (s.state == slot::PENDING) reap();
+  }
+
+  // Wait for one completion and mark its slot ready
+  void reap() {
+    uint32_t head = *cq_head;
+    while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+        throw std::runtime_error(string("io_uring_enter: ") + string(strerror(errno)));
+      }
+    }
+    struct io_uring_cqe* cqe = cqes + (head & cq_mask);
+    slot& s = slots[cqe->user_data];
+    int res = cqe->res;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+    s.state = slot::READY;
+    if (res < 0) throw std::runtime_error(string("io_uring read: ") + string(strerror(-res)));
+    if ((size_t)res < s.valid) read_rest(s, res); // short read; fetch the rest the slow way
+  }
+
+  void teardown() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_len);
+    if (cq_ring != MAP_FAILED) munmap(cq_ring, cq_ring_len);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_len);
+    if (ring_fd >= 0) ::close(ring_fd);
+    sqes = cq_ring = sq_ring = MAP_FAILED;
+    ring_fd = -1;
+  }
+
+  int ring_fd;
+  void* sq_ring;
+  void* cq_ring;
+  void* sqes;
+  size_t sq_ring_len, cq_ring_len, sqes_len;
+  uint32_t* sq_tail;
+  uint32_t sq_mask;
+  uint32_t* sq_array;
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe* cqes;
+  vector<struct iovec> iovs; // one per slot; the kernel reads these after we submit
+} ;
+
+#endif // INPUT_HAVE_URING
+
+input_source* input_source::open(const char* fn, const input_options& opts, FILE* log) {
+  switch (opts.backend) {
+    case INPUT_MMAP:
+      return new mmap_source(fn);
+    case INPUT_MMAP_SEQUENTIAL:
+      return new mmap_source(fn, false, MADV_SEQUENTIAL);
+    case INPUT_MMAP_POPULATE:
+      return new mmap_source(fn, true);
+    case INPUT_PREAD:
+      break;
+    case INPUT_URING:
+#ifdef INPUT_HAVE_URING
+      try {
+        return new uring_source(fn, opts);
+      } catch (const uring_unavailable& e) {
+        fprintf(log, "io_uring is not available (%s); reading with pread instead\n", e.what());
+      }
+#else
+      fprintf(log, "io_uring support was not compiled in; reading with pread instead\n");
+#endif
+      break;
+  }
+  return new pread_source(fn, opts);
+}
@@ -0,0 +1,76 @@
+/*
+ * input_source.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "mmfile.h"
+
+enum input_backend {
+  INPUT_MMAP,            // plain mmap(), page faults do the reading
+  INPUT_MMAP_SEQUENTIAL, // mmap() + MADV_SEQUENTIAL
+  INPUT_MMAP_POPULATE,   // mmap() + MAP_POPULATE: read the whole file in before we start
+  INPUT_PREAD,           // large pread()s into our own buffers, with posix_fadvise() readahead
+  INPUT_URING            // large reads kept in flight with io_uring
+};
+
+struct input_options {
+  input_options() : backend(INPUT_MMAP), block_size(1024 * 1024), depth(4) {}
+
+  // Parse a -input argument; returns false if it isn't a backend we know
+  bool parse_backend(const char* name);
+
+  input_backend backend;
+  size_t block_size; // size of each read for the pread and io_uring backends
+  unsigned depth; // reads kept in flight (io_uring) or advised ahead (pread)
+};
+
+// Random access to the bytes of an input file, however they get read.
+class input_source {
+public:
+  input_source() : length(0), fd(-1), bytes_read(0) {}
+  virtual ~input_source() {}
+
+  // Returns a pointer to the len bytes at offset, which must lie inside the file.
+  // The pointer stays good until the next call to fetch().
+  virtual char* fetch(uint64_t offset, size_t len) = 0;
+
+  // The whole file, if the backend has it mapped (NULL if it doesn't)
+  virtual char* base() { return NULL; }
+
+  virtual void close() = 0;
+
+  // Open fn with the backend opts asks for. If that backend isn't available here,
+  // falls back to pread (and says so on log).
+  static input_source* open(const char* fn, const input_options& opts, FILE* log);
+
+  uint64_t length;
+  int fd;
+  uint64_t bytes_read; // by the backends that read() into buffers (for -stats)
+
+private:
+  input_source(const input_source& right); // noncopyable
+  input_source& operator=(const input_source& right); // nonassignable
+} ;
+
+class mmap_source : public input_source {
+public:
+  mmap_source(const char* fn, bool populate = false, int advice = MADV_NORMAL) {
+    mm.open(fn, populate, advice);
+    length = mm.flen;
+    fd = mm.fd;
+  }
+
+  virtual char* fetch(uint64_t offset, size_t) { return mm.fbase + offset; }
+  virtual char* base() { return mm.fbase; }
+  virtual void close() { mm.close(); fd = -1; }
+
+protected:
+  mmfile mm;
+} ;
+
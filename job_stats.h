@@ -0,0 +1,168 @@
+/*
+ * job_stats.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "AMFData.h"
+#include "fout.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+/*
+  Where a hint_job's time went (-stats): wall and CPU time for each phase of the job,
+  in the order they first ran, and counters for what it read and wrote. CPU time and
+  page faults come from getrusage(RUSAGE_SELF), so they include the job's scan and
+  writer threads -- and, in -batch or daemon mode, whatever else the process was
+  doing at the same time.
+*/
+class job_stats {
+public:
+  job_stats() : started(now()), started_cpu(cpu_now()), input_bytes(0), bytes_read(0), bytes_written(0), flushes(0), seeks(0), copies(0) {
+    memset(tags, 0, sizeof(tags));
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    minor_faults = ru.ru_minflt;
+    major_faults = ru.ru_majflt;
+  }
+
+  // Add a run of a phase (phases that run more than once add up)
+  void add_phase(const char* name, double wall, double cpu) {
+    for (size_t i = 0; i < phases.size(); ++i) {
+      if (strcmp(phases[i].name, name) == 0) {
+        phases[i].wall += wall;
+        phases[i].cpu += cpu;
+        return;
+      }
+    }
+    phase p;
+    p.name = name;
+    p.wall = wall;
+    p.cpu = cpu;
+    phases.push_back(p);
+  }
+
+  // Fold in another job's phases and counters (the inputs of a -concat)
+  void add(const job_stats& r) {
+    for (size_t i = 0; i < r.phases.size(); ++i) add_phase(r.phases[i].name, r.phases[i].wall, r.phases[i].cpu);
+    for (int t = 0; t < 4; ++t) tags[t] += r.tags[t];
+    input_bytes += r.input_bytes;
+    bytes_read += r.bytes_read;
+    bytes_written += r.bytes_written;
+    flushes += r.flushes;
+    seeks += r.seeks;
+    copies += r.copies;
+    skipped.insert(skipped.end(), r.skipped.begin(), r.skipped.end());
+  }
+
+  void count_tag(char tag_type) {
+    ++tags[(tag_type == 9) ? 0 : (tag_type == 8) ? 1 : (tag_type == 18) ? 2 : 3];
+  }
+
+  // What went into an output file, once it's closed
+  void count_output(const fout& fp, uint64_t written) {
+    bytes_written += written;
+    flushes += fp.counters().flushes;
+    seeks += fp.counters().seeks;
+    copies += fp.counters().copies;
+  }
+
+  // One JSON object, on one line, saying which input it's about if input isn't NULL
+  void dumpJSON(FILE* f, const char* input = NULL) const {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    fputc('{', f);
+    if (input) {
+      fputs("\"input\":", f);
+      AMFString(input).dumpJSON(f);
+      fputc(',', f);
+    }
+    fprintf(f, "\"wall\":%.6f,\"cpu\":%.6f,\"phases\":{", now() - started, cpu_now() - started_cpu);
+    for (size_t i = 0; i < phases.size(); ++i) {
+      fprintf(f, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", i ? "," : "", phases[i].name, phases[i].wall, phases[i].cpu);
+    }
+    fprintf(f, "},\"tags\":{\"video\":%llu,\"audio\":%llu,\"meta\":%llu,\"other\":%llu}", (unsigned long long)tags[0], (unsigned long long)tags[1], (unsigned long long)tags[2], (unsigned long long)tags[3]);
+    fprintf(f, ",\"input_bytes\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,\"flushes\":%llu,\"seeks\":%llu,\"copy_ranges\":%llu",
+            (unsigned long long)input_bytes, (unsigned long long)bytes_read, (unsigned long long)bytes_written, (unsigned long long)flushes, (unsigned long long)seeks, (unsigned long long)copies);
+    if (! skipped.empty()) {
+      fputs(",\"skipped\":[", f);
+      for (size_t i = 0; i < skipped.size(); ++i) fprintf(f, "%s[%llu,%llu]", i ? "," : "", (unsigned long long)skipped[i].first, (unsigned long long)skipped[i].second);
+      fputc(']', f);
+    }
+    fprintf(f, ",\"minor_faults\":%ld,\"major_faults\":%ld,\"peak_rss_kb\":%ld}", ru.ru_minflt - minor_faults, ru.ru_majflt - major_faults, ru.ru_maxrss);
+  }
+
+  // The same, as a string
+  string json(const char* input = NULL) const {
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* f = open_memstream(&buf, &len);
+    if (! f) throw std::bad_alloc();
+    dumpJSON(f, input);
+    fclose(f);
+    string r(buf, len);
+    free(buf);
+    return r;
+  }
+
+  static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (tv.tv_usec / 1000000.0);
+  }
+
+  // User plus system CPU time used by the process so far
+  static double cpu_now() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + ((ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0);
+  }
+
+  double started, started_cpu;
+  uint64_t tags[4]; // video, audio, meta, anything else: every tag scanned
+  uint64_t input_bytes; // size of the input(s)
+  uint64_t bytes_read; // by read()-based input backends (mapped input shows up in the page faults instead)
+  uint64_t bytes_written;
+  uint64_t flushes, seeks, copies; // by the output's fout (see fout_counters)
+  long minor_faults, major_faults; // when we started
+  vector<pair<uint64_t, uint64_t> > skipped; // [from, to) byte ranges of damage -recover skipped over
+
+protected:
+  struct phase {
+    const char* name;
+    double wall, cpu;
+  };
+  vector<phase> phases;
+} ;
+
+// Times the scope it's in as a phase of a job (if stats isn't NULL)
+class phase_timer {
+public:
+  phase_timer(job_stats* _stats, const char* _name) : stats(_stats), name(_name), wall(0), cpu(0) {
+    if (! stats) return;
+    wall = job_stats::now();
+    cpu = job_stats::cpu_now();
+  }
+  ~phase_timer() { stop(); }
+
+  // End the phase before the end of the scope
+  void stop() {
+    if (stats) stats->add_phase(name, job_stats::now() - wall, job_stats::cpu_now() - cpu);
+    stats = NULL;
+  }
+
+protected:
+  job_stats* stats;
+  const char* name;
+  double wall, cpu;
+
+private:
+  phase_timer(const phase_timer& _r); // noncopyable
+  phase_timer& operator=(const phase_timer& _r); // nonassignable
+} ;
@@ -0,0 +1,284 @@
+/*
+ * libflvtool.cpp
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#include "libflvtool.h"
+#include "common.h"
+#include "flvhint.h"
+#include "cmdline.h"
+#include "verify.h"
+#include <new>
+
+#define FLVTOOL_VERSION "1.2.1"
+
+struct flvtool_ctx {
+  flvtool_ctx() : scan_threads(1), log_fn(NULL), log_user(NULL), has_result(false), has_stats(false), has_error(false) {}
+
+  hint_options opts;
+  long scan_threads;
+  flvtool_log_fn log_fn;
+  void* log_user;
+  string partial_line; // logged, but not up to the end of a line yet
+
+  string result, stats, error; // from the last call
+  bool has_result, has_stats, has_error;
+};
+
+// The log FILE a job writes to: hands it to the callback a line at a time
+static void log_lines(flvtool_ctx* ctx, const char* buf, size_t len) {
+  ctx->partial_line.append(buf, len);
+  size_t start = 0, nl;
+  while ((nl = ctx->partial_line.find('\n', start)) != string::npos) {
+    if (ctx->log_fn) ctx->log_fn(ctx->log_user, ctx->partial_line.substr(start, nl - start).c_str());
+    start = nl + 1;
+  }
+  ctx->partial_line.erase(0, start);
+}
+
+static void log_flush(flvtool_ctx* ctx) {
+  if (! ctx->partial_line.empty() && ctx->log_fn) ctx->log_fn(ctx->log_user, ctx->partial_line.c_str());
+  ctx->partial_line.clear();
+}
+
+#ifdef __APPLE__
+static int log_write(void* cookie, const char* buf, int len) {
+  log_lines((flvtool_ctx*) cookie, buf, len);
+  return len;
+}
+
+static int log_close(void* cookie) {
+  log_flush((flvtool_ctx*) cookie);
+  return 0;
+}
+
+static FILE* open_log(flvtool_ctx* ctx) {
+  return funopen(ctx, NULL, log_write, NULL, log_close);
+}
+#else
+static ssize_t log_write(void* cookie, const char* buf, size_t len) {
+  log_lines((flvtool_ctx*) cookie, buf, len);
+  return len;
+}
+
+static int log_close(void* cookie) {
+  log_flush((flvtool_ctx*) cookie);
+  return 0;
+}
+
+static FILE* open_log(flvtool_ctx* ctx) {
+  cookie_io_functions_t io = { NULL, log_write, NULL, log_close };
+  return fopencookie(ctx, "w", io);
+}
+#endif
+
+// Drop what the last call left behind
+static void forget(flvtool_ctx* ctx) {
+  ctx->result.clear();
+  ctx->stats.clear();
+  ctx->error.clear();
+  ctx->has_result = ctx->has_stats = ctx->has_error = false;
+}
+
+static int fail(flvtool_ctx* ctx, int status, const string& why) {
+  ctx->error = why;
+  ctx->has_error = true;
+  return status;
+}
+
+// What the job calls below have in common: forget the last call, and set up the log
+// and somewhere for the metadata dump to go
+class ctx_call {
+public:
+  ctx_call(flvtool_ctx* _ctx) : ctx(_ctx), log(NULL), dump(NULL), dumpbuf(NULL), dumplen(0) { forget(ctx); }
+  ~ctx_call() { finish(); }
+
+  // Open the log and the dump; false if there's no memory for them
+  bool open() {
+    log = open_log(ctx);
+    dump = open_memstream(&dumpbuf, &dumplen);
+    return log && dump;
+  }
+
+  // Close them, keeping what went into the dump as the result
+  void finish() {
+    if (log) fclose(log);
+    log = NULL;
+    if (dump) {
+      fclose(dump);
+      dump = NULL;
+      if (dumplen) {
+        ctx->result.assign(dumpbuf, dumplen);
+        ctx->has_result = true;
+      }
+    }
+    free(dumpbuf);
+    dumpbuf = NULL;
+  }
+
+  flvtool_ctx* ctx;
+  FILE* log;
+  FILE* dump;
+
+protected:
+  char* dumpbuf;
+  size_t dumplen;
+
+private:
+  ctx_call(const ctx_call& _r); // noncopyable
+  ctx_call& operator=(const ctx_call& _r); // nonassignable
+} ;
+
+enum job_kind { JOB_HINT, JOB_PROBE, JOB_CONCAT };
+
+static int run_job(flvtool_ctx* ctx, job_kind kind, const char* input, const vector<string>& inputs, const char* output) {
+  hint_options opts = ctx->opts;
+  opts.scan_threads = (ctx->scan_threads > 0) ? ctx->scan_threads : 1;
+  if (kind == JOB_PROBE) opts.nomerge = true;
+  ctx_call call(ctx);
+  if (! call.open()) return fail(ctx, FLVTOOL_ENOMEM, "out of memory");
+
+  int status = FLVTOOL_OK;
+  hint_job job(opts, call.log);
+  job.dump = call.dump;
+  try {
+    if (kind == JOB_CONCAT) job.concat(inputs, output);
+    else job.run(input, output);
+  } catch (const std::bad_alloc&) {
+    status = fail(ctx, FLVTOOL_ENOMEM, "out of memory");
+  } catch (const std::exception& e) {
+    status = fail(ctx, FLVTOOL_ERROR, e.what());
+  }
+  try {
+    ctx->stats = job.stats.json(input);
+    ctx->has_stats = true;
+  } catch (const std::exception&) {
+    // no stats, then
+  }
+  call.finish();
+  return status;
+}
+
+extern "C" {
+
+const char* flvtool_version(void) {
+  return FLVTOOL_VERSION;
+}
+
+flvtool_ctx* flvtool_new(void) {
+  try {
+    return new flvtool_ctx();
+  } catch (const std::exception&) {
+    return NULL;
+  }
+}
+
+void flvtool_free(flvtool_ctx* ctx) {
+  delete ctx;
+}
+
+void flvtool_set_log(flvtool_ctx* ctx, flvtool_log_fn fn, void* user) {
+  if (! ctx) return;
+  ctx->log_fn = fn;
+  ctx->log_user = user;
+}
+
+int flvtool_set_options(flvtool_ctx* ctx, int argc, const char* const* argv) {
+  if (! ctx || argc < 0 || (argc && ! argv)) return FLVTOOL_EINVAL;
+  forget(ctx);
+  try {
+    vector<string> args;
+    for (int i = 0; i < argc; ++i) {
+      if (! argv[i]) return fail(ctx, FLVTOOL_EINVAL, "NULL option");
+      args.push_back(argv[i]);
+    }
+    // parse into a copy, so a bad call changes nothing
+    command_line cmd;
+    cmd.opts = ctx->opts;
+    cmd.scan_threads = ctx->scan_threads;
+    string error;
+    if (! cmd.parse(args, error)) return fail(ctx, FLVTOOL_EINVAL, error);
+    if (! cmd.files.empty()) return fail(ctx, FLVTOOL_EINVAL, "not an option: " + cmd.files[0]);
+    if (cmd.job_options.size() != args.size()) return fail(ctx, FLVTOOL_EINVAL, "-batch, -concat, -daemon, -http, -j and -verify aren't options for a single job");
+    ctx->opts = cmd.opts;
+    ctx->scan_threads = cmd.scan_threads;
+    return FLVTOOL_OK;
+  } catch (const std::exception&) {
+    return fail(ctx, FLVTOOL_ENOMEM, "out of memory");
+  }
+}
+
+int flvtool_hint(flvtool_ctx* ctx, const char* input, const char* output) {
+  if (! ctx) return FLVTOOL_EINVAL;
+  forget(ctx);
+  if (! input) return fail(ctx, FLVTOOL_EINVAL, "no input filename");
+  try {
+    return run_job(ctx, JOB_HINT, input, vector<string>(), output);
+  } catch (const std::exception&) {
+    return fail(ctx, FLVTOOL_ENOMEM, "out of memory");
+  }
+}
+
+int flvtool_probe(flvtool_ctx* ctx, const char* input) {
+  if (! ctx) return FLVTOOL_EINVAL;
+  forget(ctx);
+  if (! input) return fail(ctx, FLVTOOL_EINVAL, "no input filename");
+  if (ctx->opts.inplace) return fail(ctx, FLVTOOL_EINVAL, "probe can't be used with -inplace");
+  try {
+    return run_job(ctx, JOB_PROBE, input, vector<string>(), NULL);
+  } catch (const std::exception&) {
+    return fail(ctx, FLVTOOL_ENOMEM, "out of memory");
+  }
+}
+
+int flvtool_concat(flvtool_ctx* ctx, const char* const* inputs, size_t ninputs, const char* output) {
+  if (! ctx) return FLVTOOL_EINVAL;
+  forget(ctx);
+  if (! inputs || ! ninputs) return fail(ctx, FLVTOOL_EINVAL, "no input filenames");
+  if (! output) return fail(ctx, FLVTOOL_EINVAL, "-concat needs an output filename");
+  try {
+    vector<string> in;
+    for (size_t i = 0; i < ninputs; ++i) {
+      if (! inputs[i]) return fail(ctx, FLVTOOL_EINVAL, "NULL input filename");
+      in.push_back(inputs[i]);
+    }
+    return run_job(ctx, JOB_CONCAT, NULL, in, output);
+  } catch (const std::exception&) {
+    return fail(ctx, FLVTOOL_ENOMEM, "out of memory");
+  }
+}
+
+int flvtool_verify(flvtool_ctx* ctx, const char* input) {
+  if (! ctx) return FLVTOOL_EINVAL;
+  forget(ctx);
+  if (! input) return fail(ctx, FLVTOOL_EINVAL, "no input filename");
+  try {
+    ctx_call call(ctx);
+    if (! call.open()) return fail(ctx, FLVTOOL_ENOMEM, "out of memory");
+    verify_result r = verify_file(input, ctx->opts, call.log);
+    r.dumpJSON(call.dump, input);
+    fputc('\n', call.dump);
+    call.finish();
+    if (! r.ok) return fail(ctx, FLVTOOL_EBADFILE, r.problem);
+    return FLVTOOL_OK;
+  } catch (const std::exception&) {
+    return fail(ctx, FLVTOOL_ENOMEM, "out of memory");
+  }
+}
+
+const char* flvtool_result(const flvtool_ctx* ctx) {
+  return (ctx && ctx->has_result) ? ctx->result.c_str() : NULL;
+}
+
+const char* flvtool_stats(const flvtool_ctx* ctx) {
+  return (ctx && ctx->has_stats) ? ctx->stats.c_str() : NULL;
+}
+
+const char* flvtool_error(const flvtool_ctx* ctx) {
+  return (ctx && ctx->has_error) ? ctx->error.c_str() : NULL;
+}
+
+}
@@ -0,0 +1,82 @@
+/*
+ * libflvtool.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+/*
+  libflvtool: what flvtool++ does to one file at a time (hint, dump, probe, concat,
+  verify), for programs that want to do it themselves instead of running flvtool++.
+  This is a C interface, and only ever grows: nothing here changes meaning between
+  releases, and flvtool_ctx is opaque so it can change inside.
+
+  A context holds the options and the results of the last call made with it. Calls
+  on one context have to be made one at a time, but any number of contexts can be
+  used at once on different threads; they share nothing.
+
+  Diagnostics (what flvtool++ prints as it goes) go to the log callback one line at a
+  time, without the newline, from the thread making the call. With no callback they're
+  thrown away.
+*/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* What the calls below return */
+#define FLVTOOL_OK 0
+#define FLVTOOL_ERROR -1    /* the job failed; flvtool_error() says why */
+#define FLVTOOL_EINVAL -2   /* a bad argument or option */
+#define FLVTOOL_ENOMEM -3
+#define FLVTOOL_EBADFILE -4 /* flvtool_verify(): the file failed the check */
+
+typedef struct flvtool_ctx flvtool_ctx;
+
+typedef void (*flvtool_log_fn)(void* user, const char* line);
+
+/* The flvtool++ version this is, like "1.2.1" */
+const char* flvtool_version(void);
+
+/* A new context with the default options (which scan on a single thread), or NULL if
+   there's no memory for it */
+flvtool_ctx* flvtool_new(void);
+void flvtool_free(flvtool_ctx* ctx);
+
+/* Send diagnostics to fn, which gets user back with each line; fn NULL throws them away */
+void flvtool_set_log(flvtool_ctx* ctx, flvtool_log_fn fn, void* user);
+
+/* Add options, given as flvtool++ takes them on its command line: argv holds argc
+   strings like "-nomerge", or "-padding", "4096". Filenames, and the options that
+   pick something other than a single job (-batch, -concat, -daemon, -http, -j and
+   -verify), are FLVTOOL_EINVAL. Options set before stay set. */
+int flvtool_set_options(flvtool_ctx* ctx, int argc, const char* const* argv);
+
+/* Hint input into output (- for stdout), like flvtool++ input output. With output NULL,
+   only work out input's metadata, like flvtool++ input. */
+int flvtool_hint(flvtool_ctx* ctx, const char* input, const char* output);
+/* Work out input's metadata from its tag stream alone, ignoring any onMetaData in it */
+int flvtool_probe(flvtool_ctx* ctx, const char* input);
+/* Join the ninputs files in inputs into one hinted output, like flvtool++ -concat */
+int flvtool_concat(flvtool_ctx* ctx, const char* const* inputs, size_t ninputs, const char* output);
+/* Check input's tag chain, like flvtool++ -verify */
+int flvtool_verify(flvtool_ctx* ctx, const char* input);
+
+/* What the last call found, or NULL if it didn't get that far. The strings belong to the
+   context and last until the next call on it. */
+/* The metadata dump flvtool++ would print (a line of JSON with -json); for flvtool_verify(),
+   the line of JSON -verify -json prints */
+const char* flvtool_result(const flvtool_ctx* ctx);
+/* Where the time went and what was read and written, as -stats reports it (JSON) */
+const char* flvtool_stats(const flvtool_ctx* ctx);
+/* Why the last call failed */
+const char* flvtool_error(const flvtool_ctx* ctx);
+
+#ifdef __cplusplus
+}
+#endif
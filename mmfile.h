@@ -11,17 +11,39 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <stdexcept>
+#include <errno.h>
+#include <string.h>
 
 class mmfile {
 public:
   mmfile() : fd(-1) {} 
-  mmfile(char* fn) {
-    fd = open(fn, O_RDONLY);
+  mmfile(const char* fn) : fd(-1) {
+    this->open(fn);
+  }
+
+  // populate: fault the whole file in up front (where MAP_POPULATE exists)
+  // advice: passed to madvise(), e.g. MADV_SEQUENTIAL
+  void open(const char* fn, bool populate = false, int advice = MADV_NORMAL) {
+    this->close();
+    fd = ::open(fn, O_RDONLY);
     if (fd == -1) throw std::runtime_error(string("mmfile: unable to open file ") + string(fn));
     struct stat statbuf;
     fstat(fd, &statbuf);
     flen = statbuf.st_size;
-    fbase = (char*) mmap(NULL, flen, PROT_READ, MAP_SHARED, fd, 0);
+    fbase = NULL;
+    if (! flen) return; // can't map an empty file, but there's nothing to read anyway
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (populate) flags |= MAP_POPULATE;
+#endif
+    void* p = mmap(NULL, flen, PROT_READ, flags, fd, 0);
+    if (p == MAP_FAILED) {
+      ::close(fd);
+      fd = -1;
+      throw std::runtime_error(string("mmfile: unable to map file ") + string(fn) + string(": ") + string(strerror(errno)));
+    }
+    fbase = (char*) p;
+    if (advice != MADV_NORMAL) madvise(fbase, flen, advice);
   }
 
   ~mmfile() {
@@ -30,7 +52,7 @@ public:
 
   void close() {
     if (fd != -1) {
-      munmap(fbase, flen);
+      if (fbase) munmap(fbase, flen);
       ::close(fd); // yep, namespacing. call the stdlib close()
       fd = -1;
     }
@@ -0,0 +1,365 @@
+/*
+ * pseudostream.cpp
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#include "pseudostream.h"
+#include "daemon.h"
+#include "input_source.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/sendfile.h>
+
+seek_index::seek_index(const char* filename, const hint_options& opts, FILE* log) : header_flags(0) {
+  struct stat statbuf;
+  if (stat(filename, &statbuf) != 0) throw std::runtime_error(string("can't stat ") + filename + ": " + strerror(errno));
+  dev = statbuf.st_dev;
+  ino = statbuf.st_ino;
+  size = statbuf.st_size;
+  mtime = statbuf.st_mtime;
+
+  {
+    shared_ptr<input_source> src(input_source::open(filename, opts.input, log));
+    bool indexed = read_metadata_index(*src);
+    src->close();
+    if (indexed) return;
+  }
+
+  // Not hinted (or hinted before it was changed): index the tags ourselves
+  fprintf(log, "%s has no usable keyframe index; scanning it\n", filename);
+  hint_job job(opts, log);
+  shared_ptr<input_source> src = job.index_input(filename);
+  hint_job::read_flv_header(*src, &header_flags);
+  const tag_index& tags = job.tags();
+  for (size_t i = 0; i < tags.size(); ++i) {
+    if (tags.config(i)) {
+      config_tag c;
+      c.offset = tags.offset(i);
+      c.tag_type = tags.type(i);
+      c.bytes.assign(src->fetch(c.offset, tags.tag_size(i)), tags.tag_size(i));
+      configs.push_back(c);
+    } else if (tags.type(i) == 9 && tags.keyframe(i)) {
+      times.push_back(tags.timestamp(i) / 1000.0);
+      positions.push_back(tags.offset(i));
+    }
+  }
+  src->close();
+}
+
+bool seek_index::read_metadata_index(input_source& src) {
+  uint64_t offset = hint_job::read_flv_header(src, &header_flags);
+  uint64_t end = src.length;
+  bool indexed = false;
+  // The head of the tag stream: onMetaData and the sequence headers. A hinted file has
+  // them all up front (write_flv() moves them there).
+  while (offset < end) {
+    char* tag_start = src.fetch(offset, std::min<uint64_t>(end - offset, 15));
+    if (check_tag(tag_start, end - offset) != TAG_OK) break;
+    char tag_type = tag_start[0];
+    uint32_t tag_length = peek_uint24(tag_start + 1);
+    uint8_t flags = tag_index::content_flags(tag_type, tag_length, tag_start + 11);
+    if (tag_type != 18 && ! (flags & TAG_CONFIG)) break;
+    tag_start = src.fetch(offset, 11 + tag_length + 4);
+    if (flags & TAG_CONFIG) {
+      config_tag c;
+      c.offset = offset;
+      c.tag_type = tag_type;
+      c.bytes.assign(tag_start, 11 + tag_length + 4);
+      configs.push_back(c);
+    } else if (tag_type == 18 && ! indexed) {
+      try {
+        AMFView t, p;
+        if (hint_job::find_keyframe_index(tag_start + 11, tag_length, t, p)) {
+          for (size_t i = 0; i < t.arraySize(); ++i) {
+            times.push_back(t.doubleAt(i));
+            positions.push_back((uint64_t)std::max(0.0, p.doubleAt(i)));
+          }
+          indexed = true;
+        }
+      } catch (std::exception&) {
+        times.clear();
+        positions.clear();
+      }
+    }
+    offset += 11 + tag_length + 4;
+  }
+  if (! indexed) return false;
+
+  // The index counts the AVC sequence header as a keyframe, but there's no starting there
+  while (! positions.empty() && positions.front() < offset) {
+    times.erase(times.begin());
+    positions.erase(positions.begin());
+  }
+  // Believe the index only if it's for the file as it is now: spot-check its ends
+  // (a hinted file has its positions in order, as write_flv() wrote them)
+  indexed = ! positions.empty();
+  for (size_t i = 1; i < positions.size(); ++i) {
+    if (positions[i] <= positions[i - 1]) indexed = false;
+  }
+  if (! indexed || ! hint_job::keyframe_at(src, positions.front()) || ! hint_job::keyframe_at(src, positions.back())) {
+    times.clear();
+    positions.clear();
+    configs.clear();
+    return false;
+  }
+  return true;
+}
+
+size_t seek_index::keyframe_for(const seek_request& r) const {
+  size_t k;
+  if (r.by_time) {
+    k = std::upper_bound(times.begin(), times.end(), r.start) - times.begin();
+  } else {
+    k = std::upper_bound(positions.begin(), positions.end(), (uint64_t)std::max(0.0, r.start)) - positions.begin();
+  }
+  return k ? (k - 1) : 0;
+}
+
+string seek_index::head_for(size_t k) const {
+  static const char flv_header[13] = { 'F', 'L', 'V', 0x01, 0, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00 };
+  string head(flv_header, 13);
+  head[4] = header_flags;
+  // the sequence headers in effect at the keyframe are the last of each kind before it
+  static const char tag_types[2] = { 9, 8 };
+  for (int t = 0; t < 2; ++t) {
+    const config_tag* latest = NULL;
+    for (size_t i = 0; i < configs.size() && configs[i].offset < positions[k]; ++i) {
+      if (configs[i].tag_type == tag_types[t]) latest = &configs[i];
+    }
+    if (! latest) continue;
+    string tag = latest->bytes;
+    // at time 0, wherever it was in the file
+    tag[4] = tag[5] = tag[6] = tag[7] = 0;
+    head += tag;
+  }
+  return head;
+}
+
+shared_ptr<const seek_index> seek_index_cache::get(const string& filename, const struct stat& statbuf) {
+  pthread_mutex_lock(&lock);
+  map<string, entry>::iterator it = entries.find(filename);
+  if (it != entries.end() && it->second.index->current(statbuf)) {
+    it->second.last_used = ++clock;
+    shared_ptr<const seek_index> index = it->second.index;
+    pthread_mutex_unlock(&lock);
+    return index;
+  }
+  pthread_mutex_unlock(&lock);
+
+  // Index it without holding the lock, so requests for other files don't wait behind a
+  // scan. Two requests for the same new file may both index it; the second one wins.
+  shared_ptr<const seek_index> index(new seek_index(filename.c_str(), opts, stderr));
+
+  pthread_mutex_lock(&lock);
+  entry& e = entries[filename];
+  e.index = index;
+  e.last_used = ++clock;
+  while (entries.size() > max_entries) {
+    map<string, entry>::iterator oldest = entries.begin();
+    for (it = entries.begin(); it != entries.end(); ++it) {
+      if (it->second.last_used < oldest->second.last_used) oldest = it;
+    }
+    entries.erase(oldest);
+  }
+  pthread_mutex_unlock(&lock);
+  return index;
+}
+
+static bool send_all(int fd, const char* p, size_t left) {
+  while (left) {
+    ssize_t w = ::send(fd, p, left, MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    p += w;
+    left -= w;
+  }
+  return true;
+}
+
+static int send_error(int fd, int status, const char* reason, const string& message) {
+  char buf[256];
+  string body = message + "\n";
+  snprintf(buf, sizeof(buf), "HTTP/1.0 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status, reason, body.size());
+  string response = string(buf) + body;
+  send_all(fd, response.data(), response.size());
+  return status;
+}
+
+int serve_flv(int fd, seek_index_cache& cache, const string& filename, const seek_request& r, bool head_only) {
+  int ffd = ::open(filename.c_str(), O_RDONLY);
+  struct stat statbuf;
+  if (ffd == -1 || fstat(ffd, &statbuf) != 0 || ! S_ISREG(statbuf.st_mode)) {
+    if (ffd != -1) ::close(ffd);
+    return send_error(fd, 404, "Not Found", "No such file");
+  }
+
+  string head;
+  uint64_t from = 0;
+  if (r.start > 0) {
+    try {
+      shared_ptr<const seek_index> index = cache.get(filename, statbuf);
+      if (! index->positions.empty()) {
+        size_t k = index->keyframe_for(r);
+        head = index->head_for(k);
+        from = index->positions[k];
+      }
+    } catch (std::exception& e) {
+      ::close(ffd);
+      return send_error(fd, 500, "Internal Server Error", e.what());
+    }
+  }
+
+  uint64_t length = head.size() + ((uint64_t)statbuf.st_size - std::min<uint64_t>(from, statbuf.st_size));
+  char buf[256];
+  snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\nContent-Type: video/x-flv\r\nContent-Length: %llu\r\nConnection: close\r\n\r\n", (unsigned long long)length);
+  if (send_all(fd, buf, strlen(buf)) && ! head_only && send_all(fd, head.data(), head.size())) {
+    // the rest comes straight from the page cache
+    off_t offset = from;
+    while (offset < statbuf.st_size) {
+      ssize_t w = sendfile(fd, ffd, &offset, std::min<uint64_t>(statbuf.st_size - offset, 1 << 30));
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) break; // the client went away (or the file shrank under us)
+    }
+  }
+  ::close(ffd);
+  return 200;
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// %xx decoding of a URL path; false if it's malformed
+static bool url_decode(const string& in, string& out) {
+  out.clear();
+  for (size_t i = 0; i < in.size(); ++i) {
+    if (in[i] != '%') {
+      out += in[i];
+      continue;
+    }
+    if (i + 2 >= in.size()) return false;
+    int h = hex_digit(in[i + 1]), l = hex_digit(in[i + 2]);
+    if (h < 0 || l < 0 || (h == 0 && l == 0)) return false;
+    out += (char)((h << 4) | l);
+    i += 2;
+  }
+  return true;
+}
+
+#define HTTP_MAX_REQUEST 8192
+
+// One HTTP/1.0 request: read it, answer it, hang up
+class http_connection : public work_item {
+public:
+  http_connection(int _fd, seek_index_cache& _cache) : fd(_fd), cache(_cache) {}
+
+  virtual void run() {
+    string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == string::npos && request.size() < HTTP_MAX_REQUEST) {
+      ssize_t r = ::recv(fd, buf, sizeof(buf), 0);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) break;
+      request.append(buf, r);
+    }
+    string line = request.substr(0, request.find("\r\n"));
+    int status = 400;
+    if (request.find("\r\n\r\n") != string::npos) {
+      try {
+        status = answer(line);
+      } catch (std::exception& e) {
+        status = send_error(fd, 500, "Internal Server Error", e.what());
+      }
+    } else {
+      send_error(fd, 400, "Bad Request", "Bad request");
+    }
+    fprintf(stderr, "%s %d\n", line.c_str(), status);
+    ::close(fd);
+    delete this;
+  }
+
+protected:
+  int answer(const string& line) {
+    size_t sp1 = line.find(' '), sp2 = line.rfind(' ');
+    if (sp1 == string::npos || sp2 == sp1 || line.compare(sp2 + 1, 5, "HTTP/") != 0) return send_error(fd, 400, "Bad Request", "Bad request");
+    string method = line.substr(0, sp1), target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    if (method != "GET" && method != "HEAD") return send_error(fd, 405, "Method Not Allowed", "Only GET and HEAD are supported");
+
+    size_t q = target.find('?');
+    string path, query = (q == string::npos) ? string() : target.substr(q + 1);
+    if (! url_decode(target.substr(0, q), path) || path.empty() || path[0] != '/') return send_error(fd, 400, "Bad Request", "Bad path");
+    // nothing outside the directory we serve
+    if (path.find("/../") != string::npos || path.compare(std::max<size_t>(path.size(), 3) - 3, 3, "/..") == 0) {
+      return send_error(fd, 403, "Forbidden", "Forbidden");
+    }
+
+    seek_request r;
+    size_t pos = 0;
+    while (pos < query.size()) {
+      size_t amp = query.find('&', pos);
+      string param = query.substr(pos, (amp == string::npos) ? string::npos : (amp - pos));
+      if (param.compare(0, 6, "start=") == 0) {
+        r.by_time = false;
+        r.start = strtod(param.c_str() + 6, NULL);
+      } else if (param.compare(0, 5, "time=") == 0) {
+        r.by_time = true;
+        r.start = strtod(param.c_str() + 5, NULL);
+      }
+      if (amp == string::npos) break;
+      pos = amp + 1;
+    }
+    return serve_flv(fd, cache, "." + path, r, method == "HEAD");
+  }
+
+  int fd;
+  seek_index_cache& cache;
+} ;
+
+static work_item* new_http_connection(int fd, void* cache, idle_connections&) {
+  return new http_connection(fd, *static_cast<seek_index_cache*>(cache));
+}
+
+int run_http_server(const char* address, unsigned nthreads, const hint_options& opts) {
+  string host = "127.0.0.1", port = address;
+  size_t colon = port.rfind(':');
+  if (colon != string::npos) {
+    host = port.substr(0, colon);
+    port = port.substr(colon + 1);
+  }
+
+  struct addrinfo hints, *ai = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  int err = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &ai);
+  if (err != 0) {
+    fprintf(stderr, "Can't listen on %s: %s\n", address, gai_strerror(err));
+    return -1;
+  }
+  int lfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  int on = 1;
+  if (lfd != -1) setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (lfd == -1 || bind(lfd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(lfd, 64) != 0) {
+    fprintf(stderr, "Can't listen on %s: %s\n", address, strerror(errno));
+    freeaddrinfo(ai);
+    if (lfd != -1) ::close(lfd);
+    return -1;
+  }
+  freeaddrinfo(ai);
+
+  fprintf(stderr, "flvtool++ serving the FLV files under the current directory on http://%s:%s/ (%u threads)\n", host.empty() ? "0.0.0.0" : host.c_str(), port.c_str(), nthreads);
+  seek_index_cache cache(opts);
+  serve_connections(lfd, nthreads, new_http_connection, &cache);
+  ::close(lfd);
+  return 0;
+}
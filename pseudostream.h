@@ -0,0 +1,107 @@
+/*
+ * pseudostream.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "flvhint.h"
+#include <sys/stat.h>
+#include <pthread.h>
+
+/*
+  HTTP pseudo-streaming: a player that wants to start playing part way into a file
+  asks for file.flv?start=<byte offset> (or ?time=<seconds>), and gets back a valid
+  FLV that starts at the keyframe at or before that point: a new FLV header, the
+  codec sequence headers that were in effect there, and then the rest of the file
+  from the keyframe on, which is sent with sendfile().
+
+  The keyframe index comes from the file's onMetaData if it was hinted (checked
+  against the file before it's believed), or else from a scan, and is kept in a
+  seek_index_cache so it's only worked out once per file rather than per request.
+*/
+
+// Where a request wants to start: a byte offset or a time. Either way it's moved back to a keyframe.
+struct seek_request {
+  seek_request() : by_time(false), start(0) {}
+
+  bool by_time;
+  double start; // bytes, or seconds if by_time
+};
+
+// What serving pieces of one file takes
+class seek_index {
+public:
+  // Index filename, scanning it with opts if it hasn't been hinted. Throws std::runtime_error if it can't.
+  seek_index(const char* filename, const hint_options& opts, FILE* log);
+
+  // The keyframe (position in times and positions) a request starts at
+  size_t keyframe_for(const seek_request& r) const;
+  // What goes ahead of the file's bytes from keyframe k on: a new FLV header and the
+  // sequence headers in effect at k
+  string head_for(size_t k) const;
+  // Whether the file statbuf describes is the one that was indexed, as it was then
+  bool current(const struct stat& statbuf) const {
+    return statbuf.st_dev == dev && statbuf.st_ino == ino && statbuf.st_size == size && statbuf.st_mtime == mtime;
+  }
+
+  vector<double> times; // seconds
+  vector<uint64_t> positions; // file offsets of the keyframe tags
+  // Sequence header tags (with their PreviousTagSize), by where they are in the file
+  struct config_tag {
+    uint64_t offset;
+    char tag_type;
+    string bytes;
+  } ;
+  vector<config_tag> configs;
+  uint8_t header_flags; // from the FLV header
+
+protected:
+  // From a hinted file's onMetaData; false if it hasn't got a keyframe index we can trust
+  bool read_metadata_index(input_source& src);
+
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+} ;
+
+// seek_indexes for any number of files, safe to use from any number of threads. A file's
+// index is rebuilt if the file changes. Past max_entries, the least recently used go.
+class seek_index_cache {
+public:
+  seek_index_cache(const hint_options& _opts, size_t _max_entries = 1024) : opts(_opts), max_entries(_max_entries), clock(0) { pthread_mutex_init(&lock, NULL); }
+  ~seek_index_cache() { pthread_mutex_destroy(&lock); }
+
+  // The index for filename, which statbuf describes; throws like seek_index() does
+  shared_ptr<const seek_index> get(const string& filename, const struct stat& statbuf);
+
+protected:
+  struct entry {
+    shared_ptr<const seek_index> index;
+    uint64_t last_used;
+  } ;
+
+  const hint_options& opts;
+  size_t max_entries;
+  uint64_t clock;
+  map<string, entry> entries;
+  pthread_mutex_t lock;
+
+private:
+  seek_index_cache(const seek_index_cache& _r); // noncopyable
+  seek_index_cache& operator=(const seek_index_cache& _r); // nonassignable
+} ;
+
+// Answer a pseudo-streaming request for filename with a complete HTTP/1.0 response on fd:
+// the whole file if the request starts at 0, or the piece from the keyframe it snaps to
+// (see above). Just the headers if head_only. Returns the HTTP status code it sent.
+int serve_flv(int fd, seek_index_cache& cache, const string& filename, const seek_request& r, bool head_only);
+
+// -http: serve the FLV files under the current directory on address:port, nthreads
+// requests at a time, until SIGINT or SIGTERM. Returns the exit status for main().
+int run_http_server(const char* address, unsigned nthreads, const hint_options& opts);
@@ -0,0 +1,50 @@
+/*
+ * resync.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+  Finding the tag stream again after damage (-recover). A tag header starts with a
+  type byte of 8, 9 or 18 and has a stream ID of 0 in its last three bytes, and
+  that's rare enough in compressed audio and video that testing for it 16 offsets
+  at a time, with SSE2 where we have it, gets through gigabytes of damage in about
+  the time it takes to read them. Each offset that passes still has to be checked
+  properly (see hint_job::resync()).
+*/
+
+// Whether a tag header could start at p (which needs 11 readable bytes)
+inline bool tag_header_candidate(const char* p) {
+  return (p[0] == 8 || p[0] == 9 || p[0] == 18) && ! p[8] && ! p[9] && ! p[10];
+}
+
+// The first offset in [p, end - 10) that tag_header_candidate() passes, or end if there isn't one
+inline const char* next_tag_candidate(const char* p, const char* end) {
+  if ((end - p) < 11) return end;
+  const char* last = end - 10; // candidates have to be before here
+#ifdef __SSE2__
+  const __m128i audio = _mm_set1_epi8(8), video = _mm_set1_epi8(9), meta = _mm_set1_epi8(18), zero = _mm_setzero_si128();
+  // each load covers the same byte of 16 consecutive candidate headers
+  while ((last - p) >= 16) {
+    __m128i type = _mm_loadu_si128((const __m128i*) p);
+    __m128i is_tag = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(type, audio), _mm_cmpeq_epi8(type, video)), _mm_cmpeq_epi8(type, meta));
+    __m128i stream_id = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)(p + 8)), _mm_loadu_si128((const __m128i*)(p + 9))), _mm_loadu_si128((const __m128i*)(p + 10)));
+    int hits = _mm_movemask_epi8(_mm_and_si128(is_tag, _mm_cmpeq_epi8(stream_id, zero)));
+    if (hits) return p + __builtin_ctz(hits);
+    p += 16;
+  }
+#endif
+  for (; p < last; ++p) {
+    if (tag_header_candidate(p)) return p;
+  }
+  return end;
+}
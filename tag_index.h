@@ -0,0 +1,151 @@
+/*
+ * tag_index.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <algorithm>
+#include "fout.h"
+
+// tag_index flags
+#define TAG_KEYFRAME 0x01 // video keyframe
+#define TAG_REPAIRED 0x02 // the timestamp below isn't the one in the file (see hint_job::fix_timestamp)
+#define TAG_CONFIG 0x04 // codec sequence header (AVC or AAC): needed again at the start of any piece cut out of the stream
+
+/*
+  What the scan pass learned about each tag, so nothing after it has to decode
+  tag headers again. Kept as parallel arrays (offsets, timestamps, lengths,
+  types, flags) packed into a single allocation: walking one field only touches
+  that field's memory, and the whole index costs 18 bytes a tag. write() stores
+  the arrays back to back exactly as they're laid out in memory, so an index
+  saved to disk can be attach()ed straight from a mapping of the file.
+*/
+class tag_index {
+public:
+  tag_index() : count(0), capacity(0), owned(true), block(NULL), offsets(NULL), timestamps(NULL), lengths(NULL), types(NULL), flags(NULL) {}
+  ~tag_index() { if (owned) free(block); }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  void clear() {
+    if (! owned) { // let go of attached memory rather than writing over it
+      block = NULL;
+      owned = true;
+      capacity = 0;
+    }
+    count = 0;
+  }
+
+  void push(uint64_t offset, char type, uint32_t length, uint32_t timestamp, uint8_t tag_flags) {
+    if (count == capacity) grow(capacity ? (capacity * 2) : 4096);
+    offsets[count] = offset;
+    timestamps[count] = timestamp;
+    lengths[count] = length;
+    types[count] = type;
+    flags[count] = tag_flags;
+    ++count;
+  }
+
+  uint64_t offset(size_t i) const { return offsets[i]; } // of the tag header, in the input
+  uint32_t timestamp(size_t i) const { return timestamps[i]; } // repaired
+  uint32_t length(size_t i) const { return lengths[i]; } // of the body
+  char type(size_t i) const { return types[i]; }
+  bool keyframe(size_t i) const { return flags[i] & TAG_KEYFRAME; }
+  bool repaired(size_t i) const { return flags[i] & TAG_REPAIRED; }
+  bool config(size_t i) const { return flags[i] & TAG_CONFIG; }
+  uint8_t tag_flags(size_t i) const { return flags[i]; }
+
+  // Bytes write() produces for an index of n tags
+  static size_t storage_size(size_t n) { return n * ENTRY_SIZE; }
+
+  void write(fout& fp) const {
+    fp.write((const char*) offsets, count * sizeof(uint64_t));
+    fp.write((const char*) timestamps, count * sizeof(uint32_t));
+    fp.write((const char*) lengths, count * sizeof(uint32_t));
+    fp.write(types, count);
+    fp.write((const char*) flags, count);
+  }
+
+  // Use n tags stored by write() at data (which must be 8-byte aligned) without copying them.
+  // The memory has to stay around as long as the index does, or until the next push().
+  void attach(char* data, size_t n) {
+    if (owned) free(block);
+    owned = false;
+    block = data;
+    lay_out(data, n);
+    count = capacity = n;
+  }
+
+  // Bytes the tag takes up in the file: header, body and length postfix
+  uint64_t tag_size(size_t i) const { return 11 + (uint64_t)lengths[i] + 4; }
+
+  // Whether a tag body starting with this byte is a video keyframe
+  static bool is_keyframe(char type, const char* body) {
+    return type == 9 && ((body[0] >> 4) & 0x0f) == 1;
+  }
+
+  // TAG_KEYFRAME and TAG_CONFIG, as they apply to a tag; needs the first 2 bytes of the body
+  static uint8_t content_flags(char type, uint32_t length, const char* body) {
+    uint8_t f = is_keyframe(type, body) ? TAG_KEYFRAME : 0;
+    if (length >= 2 && body[1] == 0) { // AVCPacketType / AACPacketType 0
+      if ((type == 9 && (body[0] & 0x0f) == 7) || (type == 8 && ((body[0] >> 4) & 0x0f) == 10)) f |= TAG_CONFIG;
+    }
+    return f;
+  }
+
+protected:
+  enum { ENTRY_SIZE = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint32_t) + 1 + 1 };
+
+  // Point the arrays into room for n entries at data; widest fields first, so each array stays aligned
+  void lay_out(char* data, size_t n) {
+    offsets = (uint64_t*) data;
+    timestamps = (uint32_t*)(offsets + n);
+    lengths = timestamps + n;
+    types = (char*)(lengths + n);
+    flags = (uint8_t*)(types + n);
+  }
+
+  void grow(size_t new_capacity) {
+    char* nb = (char*) malloc(new_capacity * ENTRY_SIZE);
+    if (! nb) throw std::bad_alloc();
+    uint64_t* old_offsets = offsets;
+    uint32_t* old_timestamps = timestamps;
+    uint32_t* old_lengths = lengths;
+    char* old_types = types;
+    uint8_t* old_flags = flags;
+    lay_out(nb, new_capacity);
+    if (count) {
+      memcpy(offsets, old_offsets, count * sizeof(uint64_t));
+      memcpy(timestamps, old_timestamps, count * sizeof(uint32_t));
+      memcpy(lengths, old_lengths, count * sizeof(uint32_t));
+      memcpy(types, old_types, count);
+      memcpy(flags, old_flags, count);
+    }
+    if (owned) free(block);
+    owned = true;
+    block = nb;
+    capacity = new_capacity;
+  }
+
+  size_t count, capacity;
+  bool owned; // whether block is ours to free, or attach()ed memory
+  char* block;
+  uint64_t* offsets;
+  uint32_t* timestamps;
+  uint32_t* lengths;
+  char* types;
+  uint8_t* flags;
+
+private:
+  tag_index(const tag_index& right); // noncopyable
+  tag_index& operator=(const tag_index& right); // nonassignable
+} ;
@@ -0,0 +1,94 @@
+/*
+ * verify.cpp
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#include "verify.h"
+#include <stdarg.h>
+
+static verify_result failed(verify_result& r, uint64_t offset, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+
+static verify_result failed(verify_result& r, uint64_t offset, const char* fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  r.ok = false;
+  r.offset = offset;
+  r.problem = buf;
+  return r;
+}
+
+verify_result verify_flv(input_source& src) {
+  verify_result r;
+  uint64_t end = src.length;
+  if (end < 13) return failed(r, 0, "too short for an FLV header (%llu bytes)", (unsigned long long)end);
+  const char* h = src.fetch(0, 13);
+  if (memcmp(h, "FLV\x01", 4) != 0) return failed(r, 0, "not an FLV file (bad magic or version)");
+  uint32_t header_size = peek_uint32(h + 5);
+  if (header_size < 9 || (uint64_t)header_size + 4 > end) return failed(r, 5, "bad header size %u", header_size);
+  uint64_t offset = header_size;
+  uint32_t previous = peek_uint32(src.fetch(offset, 4));
+  if (previous != 0) return failed(r, offset, "PreviousTagSize0 is %u, should be 0", previous);
+  offset += 4;
+
+  // A mapped file is walked in place; everything else goes through fetch(), which
+  // has to read the blocks in anyway
+  const char* base = src.base();
+  uint32_t last_timestamp[3] = { 0, 0, 0 }; // audio, video, script data
+  while (offset < end) {
+    if (end - offset < 11) return failed(r, offset, "%llu bytes after the last tag, not enough for a tag header", (unsigned long long)(end - offset));
+    h = base ? (base + offset) : src.fetch(offset, 11);
+    char tag_type = h[0] & 0x1f; // (the top bits are the reserved bits and the filter flag)
+    uint32_t tag_length = peek_uint24(h + 1);
+    uint32_t tag_timestamp = peek_uint24(h + 4) | ((h[7] & 0xff) << 24);
+    uint32_t stream_id = peek_uint24(h + 8);
+    if (11 + (uint64_t)tag_length + 4 > end - offset) {
+      return failed(r, offset, "tag of type %u (%u bytes) runs past the end of the file", tag_type & 0xff, tag_length);
+    }
+    if (stream_id != 0) return failed(r, offset, "tag has StreamID %u, should be 0", stream_id);
+    int track = (tag_type == 8) ? 0 : (tag_type == 9) ? 1 : (tag_type == 18) ? 2 : -1;
+    if (track >= 0) {
+      if (tag_timestamp < last_timestamp[track]) {
+        static const char* what[3] = { "audio", "video", "script data" };
+        return failed(r, offset, "%s timestamp goes backwards (%u ms after %u ms)", what[track], tag_timestamp, last_timestamp[track]);
+      }
+      last_timestamp[track] = tag_timestamp;
+    }
+    uint64_t postfix = offset + 11 + tag_length;
+    previous = peek_uint32(base ? (base + postfix) : src.fetch(postfix, 4));
+    if (previous != 11 + tag_length) return failed(r, postfix, "PreviousTagSize is %u, should be %u", previous, 11 + tag_length);
+    ++r.tags;
+    offset = postfix + 4;
+  }
+  r.ok = true;
+  return r;
+}
+
+void verify_result::dumpJSON(FILE* f, const char* filename) const {
+  fputs("{\"file\":", f);
+  AMFString(filename).dumpJSON(f);
+  fprintf(f, ",\"ok\":%s,\"tags\":%llu", ok ? "true" : "false", (unsigned long long)tags);
+  if (! ok) {
+    fprintf(f, ",\"offset\":%llu,\"problem\":", (unsigned long long)offset);
+    AMFString(problem).dumpJSON(f);
+  }
+  fputc('}', f);
+}
+
+verify_result verify_file(const char* filename, const hint_options& opts, FILE* log) {
+  try {
+    shared_ptr<input_source> src(input_source::open(filename, opts.input, log));
+    verify_result r = verify_flv(*src);
+    src->close();
+    return r;
+  } catch (const std::exception& e) {
+    verify_result r;
+    r.problem = e.what();
+    return r;
+  }
+}
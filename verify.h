@@ -0,0 +1,37 @@
+/*
+ * verify.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "input_source.h"
+#include "flvhint.h"
+
+/*
+  -verify: a structural check of the tag chain that reads nothing but the FLV header,
+  the tag headers and the PreviousTagSize fields, and decodes nothing. A file passes
+  if every tag lies inside the file, every PreviousTagSize (the one after the header
+  included) is the size of the tag before it, every StreamID is 0, and the timestamps
+  of each kind of tag (audio, video, script data) never go backwards.
+*/
+struct verify_result {
+  verify_result() : ok(false), offset(0), tags(0) {}
+
+  bool ok;
+  uint64_t offset; // of the first thing wrong (the tag, or the PreviousTagSize field)
+  string problem; // what's wrong there
+  uint64_t tags; // tags checked
+
+  // As a JSON object, saying which file it's about
+  void dumpJSON(FILE* f, const char* filename) const;
+};
+
+// Check src; stops at the first problem
+verify_result verify_flv(input_source& src);
+// The same for a file, read the way opts says; not being able to open it is a failure too
+verify_result verify_file(const char* filename, const hint_options& opts, FILE* log);
@@ -0,0 +1,185 @@
+/*
+ * workpool.h
+ * flvtool++
+ *
+ * Copyright (c) 2007-2009 Dan Weatherford and Facebook, inc.
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <stdexcept>
+#include <pthread.h>
+
+class work_item {
+public:
+  virtual ~work_item() {}
+  virtual void run() = 0;
+} ;
+
+// A fixed set of worker threads, each with its own deque of work items.
+// Workers take from the front of their own deque and, once that's empty, steal
+// from the back of everyone else's, so one long job never holds up the items
+// queued behind it. Items are owned by the caller and must outlive the pool's
+// use of them; run() must not throw.
+class work_pool {
+public:
+  work_pool(unsigned _nthreads) : nthreads(_nthreads ? _nthreads : 1), next_queue(0), queued(0), outstanding(0), stopping(false) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&work_available, NULL);
+    pthread_cond_init(&idle, NULL);
+    queues.resize(nthreads);
+    for (unsigned i = 0; i < nthreads; ++i) {
+      queues[i] = new worker_queue();
+    }
+    for (unsigned i = 0; i < nthreads; ++i) {
+      pthread_t t;
+      worker_arg* arg = new worker_arg(this, i);
+      if (pthread_create(&t, NULL, &work_pool::worker_main, arg) != 0) {
+        delete arg;
+        this->shutdown();
+        throw std::runtime_error("work_pool: unable to create worker thread");
+      }
+      threads.push_back(t);
+    }
+  }
+
+  ~work_pool() {
+    this->shutdown();
+    for (unsigned i = 0; i < nthreads; ++i) delete queues[i];
+    pthread_cond_destroy(&idle);
+    pthread_cond_destroy(&work_available);
+    pthread_mutex_destroy(&lock);
+  }
+
+  unsigned size() const { return nthreads; }
+
+  // Queue an item; submissions are dealt round-robin across the workers' deques.
+  void submit(work_item* item) {
+    pthread_mutex_lock(&lock);
+    queues[next_queue++ % nthreads]->push(item);
+    ++queued;
+    ++outstanding;
+    pthread_cond_signal(&work_available);
+    pthread_mutex_unlock(&lock);
+  }
+
+  // Block until every submitted item has finished running.
+  void wait() {
+    pthread_mutex_lock(&lock);
+    while (outstanding) pthread_cond_wait(&idle, &lock);
+    pthread_mutex_unlock(&lock);
+  }
+
+  // Finish everything that's queued, then stop and join the workers.
+  void shutdown() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&work_available);
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < threads.size(); ++i) pthread_join(threads[i], NULL);
+    threads.clear();
+  }
+
+protected:
+  class worker_queue {
+  public:
+    worker_queue() { pthread_mutex_init(&lock, NULL); }
+    ~worker_queue() { pthread_mutex_destroy(&lock); }
+
+    void push(work_item* item) {
+      pthread_mutex_lock(&lock);
+      items.push_back(item);
+      pthread_mutex_unlock(&lock);
+    }
+    // the owning worker takes from the front...
+    work_item* pop_front() {
+      work_item* r = NULL;
+      pthread_mutex_lock(&lock);
+      if (! items.empty()) {
+        r = items.front();
+        items.pop_front();
+      }
+      pthread_mutex_unlock(&lock);
+      return r;
+    }
+    // ...and thieves take from the back
+    work_item* pop_back() {
+      work_item* r = NULL;
+      pthread_mutex_lock(&lock);
+      if (! items.empty()) {
+        r = items.back();
+        items.pop_back();
+      }
+      pthread_mutex_unlock(&lock);
+      return r;
+    }
+
+  private:
+    pthread_mutex_t lock;
+    std::deque<work_item*> items;
+  } ;
+
+  struct worker_arg {
+    worker_arg(work_pool* _pool, unsigned _index) : pool(_pool), index(_index) {}
+    work_pool* pool;
+    unsigned index;
+  } ;
+
+  static void* worker_main(void* _arg) {
+    worker_arg* arg = static_cast<worker_arg*>(_arg);
+    arg->pool->worker_loop(arg->index);
+    delete arg;
+    return NULL;
+  }
+
+  work_item* take(unsigned index) {
+    work_item* item = queues[index]->pop_front();
+    for (unsigned i = 1; i < nthreads && ! item; ++i) {
+      item = queues[(index + i) % nthreads]->pop_back();
+    }
+    return item;
+  }
+
+  void worker_loop(unsigned index) {
+    while (true) {
+      work_item* item = take(index);
+      if (item) {
+        pthread_mutex_lock(&lock);
+        --queued;
+        pthread_mutex_unlock(&lock);
+
+        item->run();
+
+        pthread_mutex_lock(&lock);
+        if (--outstanding == 0) pthread_cond_broadcast(&idle);
+        pthread_mutex_unlock(&lock);
+        continue;
+      }
+      // nothing to take right now; sleep until something is submitted
+      pthread_mutex_lock(&lock);
+      while (queued == 0 && ! stopping) pthread_cond_wait(&work_available, &lock);
+      bool done = (queued == 0 && stopping);
+      pthread_mutex_unlock(&lock);
+      if (done) return;
+    }
+  }
+
+  unsigned nthreads;
+  unsigned next_queue;
+  size_t queued; // submitted but not yet taken by a worker
+  size_t outstanding; // submitted but not yet finished
+  bool stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t work_available;
+  pthread_cond_t idle;
+  std::vector<worker_queue*> queues;
+  std::vector<pthread_t> threads;
+
+private:
+  work_pool(const work_pool& _r); // noncopyable
+  work_pool& operator=(const work_pool& _r); // nonassignable
+} ;
+